@@ -66,6 +66,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 
 #ifdef CJSON
 #include <cJSON.h>
@@ -102,6 +103,15 @@
 #define APPF_MASK_SERVER 0x20000000
 #define APPF_MASK_CLIENT 0x10000000
 
+/* Poll dispatch engines (af_daemon_t.poll_engine) */
+#define AF_POLL_EPOLL    0      // epoll(7), falls back to poll(2) if unavailable
+#define AF_POLL_POLL     1      // poll(2)
+
+/* Timer engines (af_daemon_t.timer_engine) */
+#define AF_TIMER_WHEEL   0      // hierarchical timing wheel, 1 msec ticks, O(1) start/stop
+#define AF_TIMER_HEAP    1      // min-heap, exact ordering, suits a few high resolution timers
+#define AF_TIMER_LIST    2      // sorted list, O(n) start/stop
+
 
 /* struct timespec difference in msec. */
 #define timediff( x, y )	((x.tv_sec<y.tv_sec)?0:( (x.tv_sec-y.tv_sec>100000000)?0:( (x.tv_sec-y.tv_sec)*1000+(x.tv_nsec-y.tv_nsec)/1000000) ) )
@@ -115,22 +125,40 @@ struct _af_timer_control_s;
 struct _af_daemon_s;
 typedef struct _af_timer_s {
 	struct _af_timer_s        *next;
+	struct _af_timer_s        *prev;
 	// User data
 	long                       sec;
 	long                       nsec;
     void                     (*callback)( struct _af_timer_s * );
 	void                      *context;
+	int                        periodic;     // Restart every sec/nsec from the last deadline
+	long                       slack;        // msec the timer may run late, so nearby timers share a wakeup
 	// Internal data
 	int                        running;      // Is this timer running.
+	struct timespec            deadline;     // When it was asked to timeout, before slack
 	struct timespec            timeout;      // When this timer should timeout.
+	uint64_t                   expires;      // timeout in msec ticks for the wheel
+	int                        idx;          // wheel slot or heap index
+	int                        expired;      // waiting on the expired list
 
 //	struct _af_daemon_s       *daemon;
 } af_timer_t;
 
+struct _af_timer_wheel_s;
+
 typedef struct _af_timer_control_s
 {
-	af_timer_t       *head;
-	af_timer_t       *expired;
+	int               init;        // engine has been set up
+	int               engine;      // engine in use AF_TIMER_*
+	int               count;       // running timers, not counting expired
+
+	af_timer_t       *head;        // AF_TIMER_LIST
+	struct _af_timer_wheel_s *wheel; // AF_TIMER_WHEEL
+	af_timer_t      **heap;        // AF_TIMER_HEAP
+	int               heap_size;
+
+	af_timer_t       *expired;     // expired, callbacks pending
+	af_timer_t       *expired_tail;
 
 	int               fd;          // timerfd
 	struct timespec   timeout;     // when we expect a callback for timerfd 
@@ -146,8 +174,106 @@ typedef struct _af_poll_s {
 	void              *context;
 	void             (*callback)( struct _af_poll_s * );
 
+	// Internal data
+	unsigned int       gen;          // registration generation, tags epoll events
+	int                idx;          // index in the poll(2) set
+	int                embedded;     // storage belongs to the caller, never freed here
+
 } af_poll_t;
 
+typedef struct _af_poll_control_s
+{
+	af_poll_t       **table;       // registrations indexed by fd
+	int               size;        // table slots
+	int               count;       // registered fds
+
+	struct pollfd    *pfds;        // poll(2) set, count entries
+	af_poll_t       **pents;       // registration for each pfds entry
+	int               pfds_size;   // pfds/pents slots
+
+	unsigned int      gen;         // last registration generation handed out
+	int               running;     // af_poll_run dispatch depth
+	af_poll_t        *dead;        // removed during dispatch, freed after it
+
+	int               init;        // engine has been set up
+	int               engine;      // engine in use AF_POLL_EPOLL or AF_POLL_POLL
+	int               fd;          // epoll fd
+
+} af_poll_control_t;
+
+struct _af_log_ring_s;
+struct _af_log_bin_s;
+struct _af_log_limit_s;
+struct _af_log_flight_s;
+
+typedef struct _af_log_control_s
+{
+	int               init;        // logging has been set up
+	int               async;       // messages are queued to the log thread
+	int               running;     // log thread is running, it rotates and reopens in every mode
+	pthread_t         thread;      // log thread
+	pthread_mutex_t   lock;        // held by the log thread while writing, and over fork()
+	struct _af_log_ring_s *rings;  // every thread's ring, newest first
+	int               wake[2];     // pipe to wake the log thread
+	int               sleeping;    // log thread is waiting on wake[0]
+	int               stop;        // log thread should drain and exit, set by af_log_stop()
+	int               atfork;      // fork and exit handlers are registered
+	unsigned long     dropped;     // records lost to full rings
+
+	struct _af_log_bin_s *bin;     // binary log, when log_bin_filename is set
+	struct _af_log_limit_s *limits; // af_log_limit() rate limits and sampling
+	struct _af_log_flight_s *flight; // flight recorder, when flight_records is set
+	int               flight_level; // levels up to this go to the flight recorder, -1 off
+
+	volatile sig_atomic_t reopen;  // af_log_reopen() was called
+	int               maint;       // the log thread was woken to rotate or reopen
+	long              log_bytes;   // size of the log file
+	time_t            rotate_at;   // next time based rotation
+	pid_t             compress_pid; // gzip of the last rotated file
+
+	int               syslog_native; // syslog_fd is connected to /dev/log
+	int               syslog_fd;
+	char              syslog_host[64];
+	time_t            syslog_retry;  // on syslog(3), when to try /dev/log again
+	int               syslog_backoff; // secs to the next try
+
+} af_log_control_t;
+
+/*
+ * Binary log file, see appf_log_bin.c. A header, then the format strings
+ * used so far, then a ring of af_log_bin_rec_t records. Each record is
+ * followed by its arguments in 8 byte slots, strings as a 32 bit length
+ * and the bytes padded out to 8.
+ */
+#define AF_LOG_BIN_MAGIC     "AFBLOG1"
+#define AF_LOG_BIN_PAD       0xffffffff  // rec->fmt, skip to the start of the ring
+#define AF_LOG_BIN_TEXT      0xfffffffe  // rec->fmt, one preformatted string argument
+
+typedef struct _af_log_bin_hdr_s
+{
+	char              magic[8];
+	uint32_t          hdr_size;
+	uint32_t          fmt_off;     // file offset of the format strings
+	uint32_t          fmt_size;
+	uint32_t          fmt_used;    // a format's id is its offset in here
+	uint64_t          ring_off;    // file offset of the records
+	uint64_t          ring_size;
+	uint64_t          head;        // bytes ever written to the ring
+	uint64_t          tail;        // oldest whole record
+	char              name[64];    // log_name
+
+} af_log_bin_hdr_t;
+
+typedef struct _af_log_bin_rec_s
+{
+	uint32_t          len;         // whole record with arguments, 8 byte aligned
+	uint32_t          fmt;
+	uint32_t          mask;
+	uint32_t          usec;
+	int64_t           sec;
+
+} af_log_bin_rec_t;
+
 typedef struct _af_daemon_s {
 	// daemon stuff
 	char                 *appname;
@@ -158,37 +284,100 @@ typedef struct _af_daemon_s {
 	// Log stuff
 	char                 *log_name;
 	int                   use_syslog;
+	int                   syslog_native; // With use_syslog, send RFC 5424 to /dev/log ourselves, batched by log_async
 	int                   log_level;
 	int                   log_mask;
 
 	FILE                 *log_fh;
 	char                 *log_filename;
 
+	int                   log_coarse_mask; // Groups stamped with the coarse (jiffy) clock, for high volume logs
+	int                   log_async;     // Write logs from a log thread, callers only format
+	int                   log_ring_size; // Records per thread for log_async, 0 for 256
+	char                 *log_bin_filename; // Binary log written instead of the text log, read with logdump
+	int                   log_bin_size;  // Bytes kept in the binary log, 0 for 8M
+	int                   flight_records; // Last messages kept in memory for the crash handler, 0 off
+	int                   flight_level;  // Most verbose level kept, whatever log_level is, 0 for LOG_DEBUG
+	long                  log_rotate_size; // Rotate log_filename at this many bytes, 0 never
+	int                   log_rotate_secs; // Rotate log_filename every this many seconds, 0 never
+	int                   log_rotate_keep; // Rotated logs kept as .1 to .N, 0 for 5
+	int                   log_rotate_compress; // gzip rotated logs
+	af_log_control_t      logs;
+
 	// Timer stuff
+	int                   timer_engine; // AF_TIMER_WHEEL, AF_TIMER_HEAP or AF_TIMER_LIST
 	af_timer_control_t    timers;
 
 	// Poll dispatch stuff
-	af_poll_t            *poll_head;
+	int                   poll_engine;  // AF_POLL_EPOLL or AF_POLL_POLL
+	af_poll_control_t     polls;
 
 } af_daemon_t;
 
 typedef struct _af_server_s af_server_t;
 typedef struct _af_client_s af_client_t;
 typedef struct _af_server_cnx_s af_server_cnx_t;
+typedef struct _af_server_reactor_s af_server_reactor_t;
+typedef struct _af_server_slab_s af_server_slab_t;
+
+typedef struct _af_server_shared_s af_server_shared_t;
+
+// Output queued on a connection, written from poll when the socket allows
+typedef struct _af_server_buf_s {
+	struct _af_server_buf_s *next;
+	af_server_shared_t      *shared;              // broadcast data, instead of data
+	size_t                   len;                 // bytes in data
+	size_t                   off;                 // bytes already written
+	size_t                   size;                // data slots
+	char                     data[];
+} af_server_buf_t;
+
+#define AF_SERVER_BUF_SIZE       4096             // segment size for small writes
+#define AF_SERVER_BUF_SPARE      4                // freed segments of each kind a connection keeps
+#define AF_SERVER_OUT_HIGH       (64*1024)        // default out_high
+#define AF_SERVER_LINE_MAX       2048             // default max_line
+#define AF_SERVER_ACCEPT_BUDGET  32               // default accept_budget
 
 struct _af_server_cnx_s {
 	struct _af_server_cnx_s *next;
+	struct _af_server_cnx_s *prev;
 	// User data
 	void                    *user_data;           /* Opaque pointer to user data */
 	void                   (*disconnect_callback)( af_server_cnx_t *cnx );
-	struct sockaddr_in       raddr;               /* Remote socket address */
+	struct sockaddr_storage  raddr;               /* Remote socket address, IPv4, IPv6 or unix */
 
 	// Internal Data
 	af_server_t             *server;              /* Pointer back to server struct */
 	int                      fd;                  /* Connection file descriptor */
-	FILE                    *fh;                  /* Connection file handle */
+	FILE                    *fh;                  /* Connection stream, writes go to the output queue */
 	int                      inout;               // flag to indicate if it is a cnx as a client or server
 	af_client_t             *client;              // Pointer back to client struct
+	af_server_reactor_t     *reactor;             // reactor thread it runs on, NULL for the daemon's poll
+	af_poll_t                poll;                // poll registration, kept with the slot
+
+	// Output queue
+	af_server_buf_t         *out_head;
+	af_server_buf_t         *out_tail;
+	size_t                   out_bytes;           // bytes queued
+	int                      out_blocked;         // above out_high, input paused
+	int                      out_error;           // write failed, disconnect from poll
+	unsigned long            out_dropped;         // broadcasts dropped, over out_max
+	af_server_buf_t         *out_spare;           // freed AF_SERVER_BUF_SIZE segments, kept with the slot
+	af_server_buf_t         *out_spare_ref;       // freed broadcast references, kept with the slot
+	int                      out_nspare;
+	int                      out_nspare_ref;
+
+	// Input framing
+	char                    *in_buf;              // partial commands, max_line bytes
+	size_t                   in_len;
+	int                      in_skip;             // dropping an overlong command
+	int                      busy;                // in the command handler
+	int                      closed;              // disconnected while busy
+
+	// Timeouts
+	af_timer_t               timer;               // idle_timeout and session_timeout
+	struct timespec          start;               // when it was accepted
+	struct timespec          last_cmd;            // when the last command came in
 
 };
 
@@ -198,17 +387,46 @@ struct _af_server_s {
 	char            *prompt;   // Or set prompt and port*/
 	int              port;
 	int              local;    // set try to bind to INADDR_LOOPBACK
+	char            *address;  // or bind to this address or name, NULL listens on IPv6 and IPv4
+	char            *path;     // or listen on this unix socket, '@' at the start for the abstract namespace
 	int              max_cnx;  // maximum number of connections
+	int              backlog;  // listen() backlog, 0 for max_cnx
+	int              accept_budget; // connections accepted per wakeup, 0 for AF_SERVER_ACCEPT_BUDGET
+	int              reactors; // threads with their own SO_REUSEPORT listener and poll, 0 for the daemon's poll
 	// Callback for new commands
 	void           (*command_handler)( char *command, af_server_cnx_t *cnx );      
 	// Callback for new connections
 	void           (*new_connection_callback)( af_server_cnx_t *cnx, void *ctx );
 	void            *new_connection_context;
+	// Output queue watermarks, 0 for AF_SERVER_OUT_HIGH and out_high/4.
+	// Above out_high input from the connection is paused and the
+	// backpressure callback called with blocked 1, again with 0 once
+	// the queue drains to out_low.
+	size_t           out_high;
+	size_t           out_low;
+	size_t           out_max;   // broadcasts to a connection with this much queued are dropped, 0 for out_high*16
+	void           (*backpressure_callback)( af_server_cnx_t *cnx, int blocked );
+	// Command framing.  With a delimiter each complete command is passed to
+	// the command handler without it (and without a '\r' before a '\n'),
+	// so clients can send many commands without waiting for the prompt.
+	// 0 passes each read to the handler as it arrives.
+	int              delimiter;
+	size_t           max_line;  // longer commands are dropped, 0 for AF_SERVER_LINE_MAX
+	// Connections that send no complete command for idle_timeout secs, or
+	// are open for session_timeout secs, are disconnected.  0 for no limit.
+	int              idle_timeout;
+	int              session_timeout;
 
 	// Internal data
 	int              fd;
 	int              num_cnx;
 	af_server_cnx_t *cnx;	    // Connections
+	pthread_mutex_t  lock;      // num_cnx and cnx, for reactors
+	af_server_slab_t *slabs;    // connection slots
+	af_server_cnx_t *cnx_free;
+	af_server_reactor_t *reactor; // reactors threads, reactors entries
+	int              wake[2];   // a reactor asks the thread that started them to finish af_server_stop()
+	int              stopped;   // stopped from a command handler, slots freed with the last connection
 
 };
 
@@ -218,6 +436,8 @@ struct _af_client_s
 	char                *service;  // Specifiy /etc/services name
 	int                  port;     // TCP port
 	unsigned int         ip;       // Remote IP
+	char                *host;     // or resolve this name or address, IPv6 or IPv4
+	char                *path;     // or connect to this unix socket, '@' at the start for the abstract namespace
 
 	int                  sock;     // Connection
 
@@ -263,12 +483,55 @@ int af_daemon_start( void );
 void af_fatal( const char *fmt, ... ) __attribute__((format(printf, 1,2)));
 void af_log_print( unsigned int mask, const char *fmt, ... ) __attribute__((format(printf, 2,3)));
 
-int af_poll_run( int timeout );
+/*
+ * Levels above AF_LOG_COMPILE_LEVEL are compiled out, e.g. build with
+ * -DAF_LOG_COMPILE_LEVEL=LOG_INFO to drop all LOG_DEBUG. Anything else is
+ * checked against log_mask/log_level before the arguments are evaluated.
+ */
+#ifndef AF_LOG_COMPILE_LEVEL
+#define AF_LOG_COMPILE_LEVEL  LOG_DEBUG
+#endif
+
+static inline int af_log_enabled( unsigned int mask )
+{
+	unsigned int group = mask & ~LOG_PRIMASK;
+
+	// The flight recorder wants it even if the log doesn't
+	if ( (int)(mask & LOG_PRIMASK) <= _af_daemon->logs.flight_level )
+	{
+		return 1;
+	}
+
+	// no group always logs, otherwise it has to be in log_mask
+	if ( group && ((group & _af_daemon->log_mask) == 0) )
+	{
+		return 0;
+	}
+
+	return (mask & LOG_PRIMASK) <= (unsigned int)_af_daemon->log_level;
+}
+
+#define af_log_print( mask, ... ) \
+	do { \
+		if ( (((mask) & LOG_PRIMASK) <= AF_LOG_COMPILE_LEVEL) && af_log_enabled( mask ) ) \
+			(af_log_print)( (mask), __VA_ARGS__ ); \
+	} while ( 0 )
+
+int af_poll_run( int timeout );                // timeout is shortened to the next timer
 int af_poll_add( int fd, int events, void (*callback)(af_poll_t *), void *ctx );
 void af_poll_rem( int fd );
+int af_poll_modify( int fd, int events );
+int af_poll_enable( int fd, int events );     // add events, e.g. POLLOUT while output is queued
+int af_poll_disable( int fd, int events );    // remove events
 
 void af_open_logfile(void);
 void af_close_logfile(void);
+void af_log_reopen(void);                     // reopen log_filename, safe from a SIGHUP handler
+void af_log_flush(void);                      // wait for the log thread to write everything queued
+void af_log_stop(void);                       // write everything queued and end the log thread, log inline after
+int af_log_limit( unsigned int mask, int rate, int burst, int sample ); // rate limit/sample groups in mask at its level and below
+void af_log_flight_dump( int fd );           // write out the flight recorder, async signal safe
+int af_log_bin_format( char *buf, int len, const char *fmt, const void *args, int args_len ); // text of a binary record
 
 
 /*****************************************************
@@ -282,16 +545,23 @@ void af_timer_now( struct timespec *now );
 time_t *af_timer_curtime( struct timespec *then );
 void af_timer_start( af_timer_t *timer );
 void af_timer_stop( af_timer_t *timer );
+void af_timer_check( void );                  // run expired timers, af_poll_run() does this
+int af_timer_next_timeout( void );            // msec until the next timer, -1 if none
 
 // TCLI server
 int af_server_get_port( const char *service );
 char *af_server_get_prompt( const char *service );
 int af_server_start( af_server_t *server );
-void af_server_stop( af_server_t *server );
+void af_server_stop( af_server_t *server );  // from a reactor it finishes on the poll of the thread that started them
 void af_server_disconnect_all( af_server_t *server );
 
 void af_server_disconnect( af_server_cnx_t *cnx );
 void af_server_prompt( af_server_cnx_t *cnx );
+int af_server_write( af_server_cnx_t *cnx, const void *data, size_t len );
+int af_server_printf( af_server_cnx_t *cnx, const char *fmt, ... ) __attribute__((format(printf, 2,3)));
+int af_server_flush( af_server_cnx_t *cnx );    // write what the socket takes now
+int af_server_broadcast( af_server_t *server, const void *data, size_t len );
+char *af_server_cnx_addr( af_server_cnx_t *cnx, char *buf, size_t len ); // "addr port" of the peer
 
 // TCLI client
 af_client_t *af_client_new( char *service, unsigned int ip, int port, const char *prompt );
@@ -20,6 +20,9 @@
 /*****************************************************************************/
 
 #include <appf.h>
+#include <sys/un.h>
+
+extern socklen_t _af_unix_addr( struct sockaddr_un *sun, const char *path );
 
 #define MAXDECODE	250
 
@@ -46,12 +49,11 @@ typedef struct _comport {
 } comport;
 
 
-int _af_client_connect_timeout( af_client_t *client, int timeout_msec )
+int _af_client_connect_timeout( af_client_t *client, struct sockaddr *addr, socklen_t addr_len, int timeout_msec )
 {
 	int                 flags, error, c, ret = 0;
 	socklen_t           len = sizeof( error );
 	struct pollfd       pfds[1];
-	struct sockaddr_in  addr;
 
 	// Save the socket flags
 	if ( (flags = fcntl(client->sock, F_GETFL, 0)) < 0 )
@@ -68,11 +70,7 @@ int _af_client_connect_timeout( af_client_t *client, int timeout_msec )
 	}
 
 	//initiate non-blocking connect
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = htonl( client->ip );
-	addr.sin_port = htons( client->port );
-
-	ret = connect( client->sock, (struct sockaddr *)&addr, (socklen_t)sizeof(addr) );
+	ret = connect( client->sock, addr, addr_len );
 
 	if ( ret == 0 )	   //then connect succeeded right away
 		goto done;
@@ -145,8 +143,76 @@ void af_client_disconnect( af_client_t *client )
 	}
 }
 
+/*
+ * Try each address client->host resolves to, in getaddrinfo() order, until
+ * one connects.  A socket left from before may be of the wrong family, it
+ * is closed and each address gets its own.
+ */
+int _af_client_connect_host( af_client_t *client )
+{
+	struct addrinfo     hints, *res, *ai;
+	char                port[16];
+	int                 rc, ret = -1;
+
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	snprintf( port, sizeof(port), "%d", client->port );
+
+	af_client_disconnect( client );
+
+	if ( ( rc = getaddrinfo( client->host, port, &hints, &res ) ) != 0 )
+	{
+		af_log_print(APPF_MASK_CLIENT+LOG_INFO, "%s: can't resolve %s (%s)", __func__, client->host, gai_strerror(rc) );
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	for ( ai = res; ai && ret != 0; ai = ai->ai_next )
+	{
+		if ( ( client->sock = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol ) ) < 0 )
+		{
+			continue;
+		}
+
+		if ( ( ret = _af_client_connect_timeout( client, ai->ai_addr, ai->ai_addrlen, 1000 ) ) != 0 )
+		{
+			af_client_disconnect( client );
+		}
+	}
+
+	freeaddrinfo( res );
+
+	return ret;
+}
+
 int af_client_connect( af_client_t *client )
 {
+	struct sockaddr_in  addr;
+	struct sockaddr_un  sun;
+	socklen_t           sun_len;
+
+	if ( client->path )
+	{
+		if ( ( sun_len = _af_unix_addr( &sun, client->path ) ) == 0 )
+		{
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		if ( client->sock < 0 && ( client->sock = socket(AF_UNIX, SOCK_STREAM, 0) ) < 0 )
+		{
+			return -1;
+		}
+		return _af_client_connect_timeout( client, (struct sockaddr *)&sun, sun_len, 1000 );
+	}
+
+	// A host name is never second guessed with ip
+	if ( client->host )
+	{
+		return _af_client_connect_host( client );
+	}
+
 	if ( client->sock < 0 )
 	{
 		client->sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -155,7 +221,13 @@ int af_client_connect( af_client_t *client )
 			return -1;
 		}
 	}
-	return _af_client_connect_timeout( client, 1000 );
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl( client->ip );
+	addr.sin_port = htons( client->port );
+
+	return _af_client_connect_timeout( client, (struct sockaddr *)&addr, sizeof(addr), 1000 );
 }
 
 void af_client_delete( af_client_t *client )
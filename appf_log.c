@@ -19,7 +19,12 @@
 /*                                                                           */
 /*****************************************************************************/
 
+#define _GNU_SOURCE                 // sendmmsg()
 #include <appf.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <sys/un.h>
 
 void af_open_logfile( )
 {
@@ -35,23 +40,1012 @@ void af_open_logfile( )
 		}
 
 		_af_daemon->log_fh = fh;
+		_af_daemon->logs.log_bytes = ftell( fh );
+		if ( _af_daemon->log_rotate_secs > 0 )
+		{
+			_af_daemon->logs.rotate_at = time( NULL ) + _af_daemon->log_rotate_secs;
+		}
+	}
+}
+
+void af_close_logfile(void)
+{
+	if ( _af_daemon->log_fh )
+		fclose( _af_daemon->log_fh );
+
+	_af_daemon->log_fh = NULL;
+}
+
+/*
+ * Log rotation and reopen. It's all done by the log thread, which runs
+ * whenever there's a log file even if messages are written inline, so
+ * a rename or spawn never holds up whoever logs.  Only without a log
+ * thread, in a forked child, does whoever logs next do it.  Compressing
+ * is left to a gzip child, which is reaped on a later pass.
+ */
+extern char **environ;
+
+void af_log_reopen( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+
+	lc->reopen = 1;
+
+	if ( lc->running )
+	{
+		if ( write( lc->wake[1], "", 1 ) < 0 )
+		{
+			// Pipe full, it's awake anyway
+		}
+	}
+}
+
+void _af_log_compress( const char *path )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	char             *argv[] = { "gzip", "-f", (char *)path, NULL };
+
+	// posix_spawn, a fork() here would run the pthread_atfork() handlers
+	if ( posix_spawnp( &lc->compress_pid, "gzip", NULL, NULL, argv, environ ) != 0 )
+	{
+		lc->compress_pid = 0;
+	}
+}
+
+void _af_log_rotate( void )
+{
+	char             *name = _af_daemon->log_filename;
+	char              from[PATH_MAX];
+	char              to[PATH_MAX];
+	int               keep;
+	int               i;
+
+	keep = ( _af_daemon->log_rotate_keep > 0 ) ? _af_daemon->log_rotate_keep : 5;
+
+	af_close_logfile( );
+
+	for ( i = keep - 1; i >= 1; i-- )
+	{
+		snprintf( from, sizeof(from), "%s.%d", name, i );
+		snprintf( to, sizeof(to), "%s.%d", name, i + 1 );
+		rename( from, to );
+		snprintf( from, sizeof(from), "%s.%d.gz", name, i );
+		snprintf( to, sizeof(to), "%s.%d.gz", name, i + 1 );
+		rename( from, to );
+	}
+
+	snprintf( to, sizeof(to), "%s.1", name );
+	rename( name, to );
+
+	af_open_logfile( );
+
+	if ( _af_daemon->log_rotate_compress )
+	{
+		_af_log_compress( to );
+	}
+}
+
+/* Reopen or rotate if it's due, called with the log lock held */
+void _af_log_maintain( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	int               err = errno;
+
+	lc->maint = 0;
+
+	if ( lc->compress_pid > 0 && waitpid( lc->compress_pid, NULL, WNOHANG ) != 0 )
+	{
+		lc->compress_pid = 0;
+	}
+
+	if ( _af_daemon->log_filename == NULL )
+	{
+		lc->reopen = 0;
+	}
+	else if ( ((_af_daemon->log_rotate_size > 0) && (lc->log_bytes >= _af_daemon->log_rotate_size)) ||
+			  ((_af_daemon->log_rotate_secs > 0) && (time( NULL ) >= lc->rotate_at)) )
+	{
+		lc->reopen = 0;
+		_af_log_rotate( );
+	}
+	else if ( lc->reopen )
+	{
+		lc->reopen = 0;
+		af_close_logfile( );
+		af_open_logfile( );
+	}
+
+	errno = err;
+}
+
+/* Quick check for a reopen or rotation */
+int _af_log_rotate_due( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+
+	return lc->reopen ||
+		   ((_af_daemon->log_rotate_size > 0) && (lc->log_bytes >= _af_daemon->log_rotate_size)) ||
+		   ((_af_daemon->log_rotate_secs > 0) && (time( NULL ) >= lc->rotate_at));
+}
+
+/* Quick check if _af_log_maintain() has anything to do */
+int _af_log_maintain_due( void )
+{
+	return _af_daemon->logs.compress_pid || _af_log_rotate_due( );
+}
+
+/* An inline writer found a rotation due, called with the log lock held */
+void _af_log_maintain_kick( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+
+	if ( !lc->running )
+	{
+		_af_log_maintain( );
+	}
+	else if ( !lc->maint )
+	{
+		lc->maint = 1;
+		if ( write( lc->wake[1], "", 1 ) < 0 )
+		{
+			// Pipe full, it's awake anyway
+		}
+	}
+}
+
+/*
+ * Async logging. Each thread formats into its own single producer ring
+ * and the log thread is the single consumer, so neither side takes a
+ * lock. The log thread writes the records out in batches with writev().
+ * Messages longer than AF_LOG_MSG_MAX are cut short.
+ */
+#define AF_LOG_MSG_MAX    512
+#define AF_LOG_RING_MIN   256
+#define AF_LOG_BATCH      64
+#define AF_LOG_LINGER     500       // usec the log thread waits for more after a wakeup
+
+typedef struct _af_log_rec_s
+{
+	struct timeval    tv;
+	unsigned int      mask;
+	int               len;
+	char              msg[AF_LOG_MSG_MAX];
+} af_log_rec_t;
+
+typedef struct _af_log_ring_s
+{
+	struct _af_log_ring_s *next;
+	unsigned int      size;        // power of 2
+	unsigned int      head;        // written by the owning thread
+	unsigned int      tail;        // written by the log thread
+	int               owned;       // a thread is using it, else free to reuse
+	af_log_rec_t     *rec;
+} af_log_ring_t;
+
+__thread af_log_ring_t *_af_log_ring;
+pthread_key_t _af_log_key;
+
+/*
+ * Log timestamps. The "mm-dd-yyyy hh:mm:ss." part only changes once a
+ * second, so each thread keeps the last one and just fills in the usecs.
+ */
+__thread time_t _af_log_sec = -1;
+__thread char   _af_log_sec_buf[32];
+__thread int    _af_log_sec_len;
+
+void _af_log_time( unsigned int msg_mask, struct timeval *tv )
+{
+#ifdef CLOCK_REALTIME_COARSE
+	struct timespec ts;
+
+	// Timer tick resolution, but no syscall even without a vDSO
+	if ( (msg_mask & ~LOG_PRIMASK) & _af_daemon->log_coarse_mask )
+	{
+		clock_gettime( CLOCK_REALTIME_COARSE, &ts );
+		tv->tv_sec = ts.tv_sec;
+		tv->tv_usec = ts.tv_nsec / 1000;
+		return;
+	}
+#endif
+	gettimeofday( tv, NULL );
+}
+
+/* "mm-dd-yyyy hh:mm:ss.uuuuuu name: " */
+int _af_log_prefix( char *buf, int len, struct timeval *tv )
+{
+	struct tm      tm;
+	int            usec;
+	int            nlen;
+	int            i;
+
+	if ( tv->tv_sec != _af_log_sec )
+	{
+		localtime_r( &tv->tv_sec, &tm );
+		_af_log_sec_len = strftime( _af_log_sec_buf, sizeof(_af_log_sec_buf), "%m-%d-%Y %T.", &tm );
+		_af_log_sec = tv->tv_sec;
+	}
+
+	nlen = _af_daemon->log_name ? strlen( _af_daemon->log_name ) : len;
+	if ( _af_log_sec_len + 6 + 1 + nlen + 2 >= len )
+	{
+		return snprintf( buf, len, "%s%06d %s: ", _af_log_sec_buf, (int)tv->tv_usec, _af_daemon->log_name );
+	}
+
+	memcpy( buf, _af_log_sec_buf, _af_log_sec_len );
+	buf += _af_log_sec_len;
+
+	usec = tv->tv_usec;
+	for ( i = 5; i >= 0; i-- )
+	{
+		buf[i] = '0' + usec % 10;
+		usec /= 10;
+	}
+	buf[6] = ' ';
+	buf += 7;
+
+	memcpy( buf, _af_daemon->log_name, nlen );
+	buf[nlen] = ':';
+	buf[nlen + 1] = ' ';
+	buf[nlen + 2] = '\0';
+
+	return _af_log_sec_len + 7 + nlen + 2;
+}
+
+/*
+ * Native syslog. RFC 5424 datagrams on our own connected socket to
+ * /dev/log instead of syslog(3), so the log thread can send a whole
+ * batch with one sendmmsg(). Facility is LOCAL7, as with openlog().
+ */
+#define AF_LOG_SYSLOG_PATH   "/dev/log"
+#define AF_LOG_SYSLOG_HDR    192
+#define AF_LOG_SYSLOG_FACILITY LOG_LOCAL7
+#define AF_LOG_SYSLOG_BACKOFF  5           // secs, doubling up to AF_LOG_SYSLOG_BACKOFF_MAX
+#define AF_LOG_SYSLOG_BACKOFF_MAX 300
+
+#if defined(__linux__) && defined(__GLIBC__) && \
+	((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 14)))
+#define AF_HAVE_SENDMMSG     1
+#else
+struct mmsghdr
+{
+	struct msghdr     msg_hdr;
+	unsigned int      msg_len;
+};
+#endif
+
+__thread time_t _af_log_utc_sec = -1;
+__thread char   _af_log_utc_buf[32];
+
+int _af_log_syslog_open( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	struct sockaddr_un sun;
+	int               fd;
+
+	if ( ( fd = socket( AF_UNIX, SOCK_DGRAM, 0 ) ) < 0 )
+	{
+		return -1;
+	}
+	fcntl( fd, F_SETFD, FD_CLOEXEC );
+
+	memset( &sun, 0, sizeof(sun) );
+	sun.sun_family = AF_UNIX;
+	strcpy( sun.sun_path, AF_LOG_SYSLOG_PATH );
+
+	if ( connect( fd, (struct sockaddr *)&sun, sizeof(sun) ) < 0 )
+	{
+		close( fd );
+		return -1;
+	}
+
+	if ( gethostname( lc->syslog_host, sizeof(lc->syslog_host) ) < 0 || lc->syslog_host[0] == '\0' )
+	{
+		strcpy( lc->syslog_host, "-" );
+	}
+	lc->syslog_host[sizeof(lc->syslog_host) - 1] = '\0';
+
+	lc->syslog_fd = fd;
+	lc->syslog_native = 1;
+	lc->syslog_backoff = 0;
+
+	// Back from syslog(3)
+	closelog( );
+
+	return 0;
+}
+
+/*
+ * No /dev/log, use syslog(3) with the same ident and facility until
+ * _af_log_syslog_retry() gets it back. Called with the log lock held.
+ */
+void _af_log_syslog_fallback( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+
+	openlog( _af_daemon->log_name, LOG_PID | LOG_NDELAY, AF_LOG_SYSLOG_FACILITY );
+
+	lc->syslog_backoff = lc->syslog_backoff ? lc->syslog_backoff * 2 : AF_LOG_SYSLOG_BACKOFF;
+	if ( lc->syslog_backoff > AF_LOG_SYSLOG_BACKOFF_MAX )
+	{
+		lc->syslog_backoff = AF_LOG_SYSLOG_BACKOFF_MAX;
+	}
+	lc->syslog_retry = time( NULL ) + lc->syslog_backoff;
+}
+
+/* Try /dev/log again if native syslog was asked for and the backoff is up */
+void _af_log_syslog_retry( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+
+	if ( !_af_daemon->use_syslog || !_af_daemon->syslog_native || lc->syslog_native ||
+		 time( NULL ) < lc->syslog_retry )
+	{
+		return;
+	}
+
+	if ( _af_log_syslog_open( ) < 0 )
+	{
+		_af_log_syslog_fallback( );
+	}
+}
+
+/* "<PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID - - " */
+int _af_log_syslog_hdr( char *buf, int len, unsigned int msg_mask, struct timeval *tv )
+{
+	struct tm      tm;
+
+	if ( tv->tv_sec != _af_log_utc_sec )
+	{
+		gmtime_r( &tv->tv_sec, &tm );
+		strftime( _af_log_utc_buf, sizeof(_af_log_utc_buf), "%Y-%m-%dT%H:%M:%S", &tm );
+		_af_log_utc_sec = tv->tv_sec;
+	}
+
+	return snprintf( buf, len, "<%d>1 %s.%06dZ %s %s %d - - ",
+					 AF_LOG_SYSLOG_FACILITY | (msg_mask & LOG_PRIMASK),
+					 _af_log_utc_buf, (int)tv->tv_usec,
+					 _af_daemon->logs.syslog_host,
+					 _af_daemon->log_name ? _af_daemon->log_name : "-",
+					 (int)getpid() );
+}
+
+/*
+ * Send cnt datagrams, reconnecting once if syslogd went away. If that
+ * fails the rest go through syslog(3). Called with the log lock held.
+ */
+void _af_log_syslog_send( struct mmsghdr *msgs, int cnt )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	struct iovec     *iov;
+	int               retry = 1;
+	int               sent;
+
+	while ( cnt > 0 )
+	{
+#ifdef AF_HAVE_SENDMMSG
+		sent = sendmmsg( lc->syslog_fd, msgs, cnt, 0 );
+#else
+		sent = ( sendmsg( lc->syslog_fd, &msgs->msg_hdr, 0 ) < 0 ) ? -1 : 1;
+#endif
+		if ( sent > 0 )
+		{
+			msgs += sent;
+			cnt -= sent;
+			continue;
+		}
+
+		if ( errno == EINTR )
+		{
+			continue;
+		}
+
+		if ( retry-- && (errno == ECONNREFUSED || errno == ENOTCONN || errno == ENOENT) )
+		{
+			close( lc->syslog_fd );
+			lc->syslog_native = 0;
+			if ( _af_log_syslog_open( ) == 0 )
+			{
+				continue;
+			}
+
+			_af_log_syslog_fallback( );
+			for ( ; cnt > 0; msgs++, cnt-- )
+			{
+				iov = msgs->msg_hdr.msg_iov;
+				syslog( atoi( (char *)iov[0].iov_base + 1 ) & LOG_PRIMASK, "%.*s",
+						(int)iov[1].iov_len, (char *)iov[1].iov_base );
+			}
+		}
+
+		// Nothing we can do about it, and nowhere to say so
+		return;
+	}
+}
+
+/* One message, when there is no log thread to batch them */
+void _af_log_syslog_vsend( unsigned int msg_mask, const char *format, va_list ap )
+{
+	struct mmsghdr    msg;
+	struct iovec      iov[2];
+	struct timeval    tv;
+	char              hdr[AF_LOG_SYSLOG_HDR];
+	char              text[1024];
+	va_list           nap;
+	int               len;
+
+	_af_log_time( msg_mask, &tv );
+
+	va_copy(nap,ap);
+	len = vsnprintf( text, sizeof(text), format, nap );
+	va_end(nap);
+	if ( len < 0 )
+		len = 0;
+	else if ( len >= sizeof(text) )
+		len = sizeof(text) - 1;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = _af_log_syslog_hdr( hdr, sizeof(hdr), msg_mask, &tv );
+	iov[1].iov_base = text;
+	iov[1].iov_len = len;
+
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_hdr.msg_iov = iov;
+	msg.msg_hdr.msg_iovlen = 2;
+
+	_af_log_syslog_send( &msg, 1 );
+}
+
+// Thread exit, hand the ring back for the next thread.
+void _af_log_ring_release( void *arg )
+{
+	af_log_ring_t *ring = arg;
+
+	__atomic_store_n( &ring->owned, 0, __ATOMIC_RELEASE );
+}
+
+af_log_ring_t *_af_log_ring_get( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	af_log_ring_t    *ring;
+	unsigned int      size;
+	int               zero;
+
+	if ( _af_log_ring )
+	{
+		return _af_log_ring;
+	}
+
+	// Reuse one a dead thread left behind, once it's been written out
+	for ( ring = __atomic_load_n( &lc->rings, __ATOMIC_ACQUIRE ); ring; ring = ring->next )
+	{
+		zero = 0;
+		if ( (__atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) == ring->head) &&
+			 __atomic_compare_exchange_n( &ring->owned, &zero, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) )
+		{
+			break;
+		}
+	}
+
+	if ( ring == NULL )
+	{
+		for ( size = AF_LOG_RING_MIN; size < _af_daemon->log_ring_size; size *= 2 )
+			;
+
+		if ( ( ring = calloc( 1, sizeof(af_log_ring_t) ) ) == NULL )
+		{
+			return NULL;
+		}
+		if ( ( ring->rec = malloc( size * sizeof(af_log_rec_t) ) ) == NULL )
+		{
+			free( ring );
+			return NULL;
+		}
+		ring->size = size;
+		ring->owned = 1;
+
+		ring->next = __atomic_load_n( &lc->rings, __ATOMIC_RELAXED );
+		while ( !__atomic_compare_exchange_n( &lc->rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+			;
+	}
+
+	pthread_setspecific( _af_log_key, ring );
+	_af_log_ring = ring;
+
+	return ring;
+}
+
+// Queue a record for the log thread, returns -1 to log it inline instead.
+int _af_log_queue( unsigned int msg_mask, const char *format, va_list ap )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	af_log_ring_t    *ring;
+	af_log_rec_t     *rec;
+	unsigned int      head;
+	va_list           nap;
+
+	if ( ( ring = _af_log_ring_get( ) ) == NULL )
+	{
+		return -1;
+	}
+
+	head = ring->head;
+	if ( head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) >= ring->size )
+	{
+		// Full, never block the caller
+		__atomic_add_fetch( &lc->dropped, 1, __ATOMIC_RELAXED );
+		return 0;
+	}
+
+	rec = &ring->rec[head & (ring->size - 1)];
+
+	_af_log_time( msg_mask, &rec->tv );
+	rec->mask = msg_mask;
+
+	va_copy(nap,ap);
+	rec->len = vsnprintf( rec->msg, sizeof(rec->msg), format, nap );
+	va_end(nap);
+
+	if ( rec->len < 0 )
+	{
+		rec->len = 0;
+	}
+	else if ( rec->len >= sizeof(rec->msg) )
+	{
+		rec->len = sizeof(rec->msg) - 1;
+	}
+
+	__atomic_store_n( &ring->head, head + 1, __ATOMIC_SEQ_CST );
+
+	if ( __atomic_load_n( &lc->sleeping, __ATOMIC_SEQ_CST ) )
+	{
+		if ( write( lc->wake[1], "", 1 ) < 0 )
+		{
+			// Pipe full, it's awake anyway
+		}
+	}
+
+	return 0;
+}
+
+// Write out everything in the ring, returns the number of records.
+int _af_log_drain( af_log_ring_t *ring )
+{
+	struct iovec      iov[AF_LOG_BATCH * 3];
+	char              prefix[AF_LOG_BATCH][128];
+	struct mmsghdr    msgs[AF_LOG_BATCH];
+	struct iovec      siov[AF_LOG_BATCH * 2];
+	char              shdr[AF_LOG_BATCH][AF_LOG_SYSLOG_HDR];
+	int               native;
+	af_log_rec_t     *rec;
+	unsigned int      tail;
+	unsigned int      head;
+	FILE             *fh;
+	int               total = 0;
+	ssize_t           n;
+	int               cnt;
+	int               i;
+
+	tail = ring->tail;
+	head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+
+	while ( tail != head )
+	{
+		pthread_mutex_lock( &_af_daemon->logs.lock );
+
+		if ( _af_log_maintain_due( ) )
+		{
+			_af_log_maintain( );
+		}
+
+		fh = _af_daemon->log_fh;
+		if ( !fh && !_af_daemon->daemonize )
+			fh = stdout;
+
+		_af_log_syslog_retry( );
+		native = _af_daemon->use_syslog && _af_daemon->logs.syslog_native;
+
+		for ( cnt = 0, i = 0; (tail + cnt != head) && (cnt < AF_LOG_BATCH); cnt++ )
+		{
+			rec = &ring->rec[(tail + cnt) & (ring->size - 1)];
+
+			if ( native )
+			{
+				siov[cnt * 2].iov_base = shdr[cnt];
+				siov[cnt * 2].iov_len = _af_log_syslog_hdr( shdr[cnt], sizeof(shdr[cnt]), rec->mask, &rec->tv );
+				siov[cnt * 2 + 1].iov_base = rec->msg;
+				siov[cnt * 2 + 1].iov_len = rec->len;
+				memset( &msgs[cnt], 0, sizeof(msgs[cnt]) );
+				msgs[cnt].msg_hdr.msg_iov = &siov[cnt * 2];
+				msgs[cnt].msg_hdr.msg_iovlen = 2;
+			}
+			else if ( _af_daemon->use_syslog )
+			{
+				syslog( rec->mask & LOG_PRIMASK, "%s", rec->msg );
+			}
+
+			if ( fh )
+			{
+				iov[i].iov_base = prefix[cnt];
+				iov[i++].iov_len = _af_log_prefix( prefix[cnt], sizeof(prefix[cnt]), &rec->tv );
+				iov[i].iov_base = rec->msg;
+				iov[i++].iov_len = rec->len;
+				iov[i].iov_base = "\n";
+				iov[i++].iov_len = 1;
+			}
+		}
+
+		if ( i && ( n = writev( fileno( fh ), iov, i ) ) > 0 )
+		{
+			_af_daemon->logs.log_bytes += n;
+		}
+
+		if ( native )
+		{
+			_af_log_syslog_send( msgs, cnt );
+		}
+
+		pthread_mutex_unlock( &_af_daemon->logs.lock );
+
+		tail += cnt;
+		total += cnt;
+		__atomic_store_n( &ring->tail, tail, __ATOMIC_RELEASE );
+
+		head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+	}
+
+	return total;
+}
+
+int _af_log_drain_all( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	af_log_ring_t    *ring;
+	int               total = 0;
+
+	for ( ring = __atomic_load_n( &lc->rings, __ATOMIC_ACQUIRE ); ring; ring = ring->next )
+	{
+		total += _af_log_drain( ring );
+	}
+
+	return total;
+}
+
+int _af_log_pending( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	af_log_ring_t    *ring;
+
+	for ( ring = __atomic_load_n( &lc->rings, __ATOMIC_ACQUIRE ); ring; ring = ring->next )
+	{
+		if ( __atomic_load_n( &ring->head, __ATOMIC_SEQ_CST ) != __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) )
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void _af_log_limit_report( int force );
+
+void *_af_log_thread( void *arg )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	struct pollfd     pfd;
+	unsigned long     dropped = 0;
+	unsigned long     now_dropped;
+	char              buf[64];
+
+	pfd.fd = lc->wake[0];
+	pfd.events = POLLIN;
+
+	for ( ; ; )
+	{
+		if ( _af_log_drain_all( ) )
+		{
+			continue;
+		}
+
+		now_dropped = __atomic_load_n( &lc->dropped, __ATOMIC_RELAXED );
+		if ( now_dropped != dropped )
+		{
+			af_log_print( LOG_WARNING, "log: %lu messages dropped, log ring full", now_dropped - dropped );
+			dropped = now_dropped;
+			continue;
+		}
+
+		if ( _af_log_maintain_due( ) )
+		{
+			pthread_mutex_lock( &lc->lock );
+			_af_log_maintain( );
+			pthread_mutex_unlock( &lc->lock );
+		}
+
+		// Suppressed counts left when a flood stops
+		_af_log_limit_report( 0 );
+
+		if ( __atomic_load_n( &lc->stop, __ATOMIC_ACQUIRE ) )
+		{
+			break;
+		}
+
+		// Anything queued after this is seen, or it sees us sleeping
+		__atomic_store_n( &lc->sleeping, 1, __ATOMIC_SEQ_CST );
+		if ( !_af_log_pending( ) )
+		{
+			poll( &pfd, 1, 1000 );
+			__atomic_store_n( &lc->sleeping, 0, __ATOMIC_SEQ_CST );
+			while ( read( lc->wake[0], buf, sizeof(buf) ) > 0 )
+				;
+
+			// Let a batch build up, rather than a wakeup per line
+			usleep( AF_LOG_LINGER );
+		}
+		__atomic_store_n( &lc->sleeping, 0, __ATOMIC_SEQ_CST );
+	}
+
+	return NULL;
+}
+
+void af_log_flush( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	int               i;
+
+	// Suppressed counts not reported yet go out with the rest
+	_af_log_limit_report( 1 );
+
+	if ( !lc->running || pthread_equal( pthread_self( ), lc->thread ) )
+	{
+		return;
+	}
+
+	// Give it a second, don't hang a dying process
+	for ( i = 0; (i < 1000) && _af_log_pending( ); i++ )
+	{
+		if ( write( lc->wake[1], "", 1 ) < 0 )
+		{
+			// Pipe full, it's awake anyway
+		}
+		usleep( 1000 );
 	}
 }
 
-void af_close_logfile(void)
+/*
+ * Don't fork while the log thread is inside localtime() or stdio, their
+ * locks would stay held in the child.
+ */
+void _af_log_fork_prepare( void )
 {
-	if ( _af_daemon->log_fh )
-		fclose( _af_daemon->log_fh );
+	pthread_mutex_lock( &_af_daemon->logs.lock );
+}
 
-	_af_daemon->log_fh = NULL;
+void _af_log_fork_parent( void )
+{
+	pthread_mutex_unlock( &_af_daemon->logs.lock );
+}
+
+// A forked child has no log thread, log inline.
+void _af_log_fork_child( void )
+{
+	pthread_mutex_unlock( &_af_daemon->logs.lock );
+	_af_daemon->logs.async = 0;
+	_af_daemon->logs.running = 0;
+}
+
+void _af_log_start_thread( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	int               i;
+
+	if ( pipe( lc->wake ) < 0 )
+	{
+		af_log_print( LOG_ERR, "%s: pipe() failed, errno %d (%s), logging inline", __func__, errno, strerror(errno) );
+		return;
+	}
+
+	for ( i = 0; i < 2; i++ )
+	{
+		fcntl( lc->wake[i], F_SETFL, fcntl( lc->wake[i], F_GETFL ) | O_NONBLOCK );
+		fcntl( lc->wake[i], F_SETFD, FD_CLOEXEC );
+	}
+
+	// Once, a restarted log thread keeps the rings
+	if ( !lc->atfork )
+	{
+		pthread_key_create( &_af_log_key, _af_log_ring_release );
+	}
+
+	if ( ( errno = pthread_create( &lc->thread, NULL, _af_log_thread, NULL ) ) != 0 )
+	{
+		af_log_print( LOG_ERR, "%s: pthread_create() failed, errno %d (%s), logging inline", __func__, errno, strerror(errno) );
+		close( lc->wake[0] );
+		close( lc->wake[1] );
+		return;
+	}
+
+	lc->running = 1;
+
+	if ( !lc->atfork )
+	{
+		pthread_atfork( _af_log_fork_prepare, _af_log_fork_parent, _af_log_fork_child );
+		atexit( af_log_stop );
+		lc->atfork = 1;
+	}
+}
+
+void af_log_stop( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+
+	if ( !lc->running || pthread_equal( pthread_self( ), lc->thread ) )
+	{
+		return;
+	}
+
+	// New messages are written inline from here on
+	lc->async = 0;
+
+	__atomic_store_n( &lc->stop, 1, __ATOMIC_RELEASE );
+	if ( write( lc->wake[1], "", 1 ) < 0 )
+	{
+		// Pipe full, it's awake anyway
+	}
+	pthread_join( lc->thread, NULL );
+
+	// Whatever was queued while it was on its way out
+	_af_log_drain_all( );
+
+	close( lc->wake[0] );
+	close( lc->wake[1] );
+	lc->stop = 0;
+	lc->maint = 0;
+	lc->running = 0;
+}
+
+/*
+ * Flight recorder. The last flight_records messages, up to flight_level
+ * whatever the log filters say, kept in memory so af_seg_fault_handler
+ * can write them out. Writers claim a slot with one atomic add, its seq
+ * is only set once the slot is complete so a dump skips torn ones.
+ */
+#define AF_LOG_FLIGHT_MSG    240
+
+typedef struct _af_log_flight_rec_s
+{
+	unsigned long     seq;         // claim number + 1 once written, 0 while writing
+	struct timeval    tv;
+	unsigned int      mask;
+	char              msg[AF_LOG_FLIGHT_MSG];
+} af_log_flight_rec_t;
+
+typedef struct _af_log_flight_s
+{
+	unsigned long     next;        // next claim number
+	unsigned long     size;
+	af_log_flight_rec_t rec[];
+} af_log_flight_t;
+
+extern void af_log_signal( int fd, char *data );
+extern char *af_itoa( int num, char *str, int base );
+
+void _af_log_flight_open( void )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	af_log_flight_t  *fl;
+
+	lc->flight_level = -1;
+
+	if ( _af_daemon->flight_records <= 0 || lc->flight )
+	{
+		return;
+	}
+
+	fl = calloc( 1, sizeof(af_log_flight_t) + _af_daemon->flight_records * sizeof(af_log_flight_rec_t) );
+	if ( fl == NULL )
+	{
+		af_log_print( LOG_ERR, "%s: no memory for %d flight records", __func__, _af_daemon->flight_records );
+		return;
+	}
+	fl->size = _af_daemon->flight_records;
+
+	lc->flight = fl;
+	lc->flight_level = _af_daemon->flight_level ? _af_daemon->flight_level : LOG_DEBUG;
+}
+
+void _af_log_flight_record( af_log_flight_t *fl, unsigned int msg_mask, const char *format, va_list ap )
+{
+	af_log_flight_rec_t *rec;
+	unsigned long     seq;
+	va_list           nap;
+
+	seq = __atomic_fetch_add( &fl->next, 1, __ATOMIC_RELAXED );
+	rec = &fl->rec[seq % fl->size];
+
+	__atomic_store_n( &rec->seq, 0, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+
+	_af_log_time( msg_mask, &rec->tv );
+	rec->mask = msg_mask;
+
+	va_copy(nap,ap);
+	vsnprintf( rec->msg, sizeof(rec->msg), format, nap );
+	va_end(nap);
+
+	__atomic_store_n( &rec->seq, seq + 1, __ATOMIC_RELEASE );
+}
+
+/*
+ * Only write(2) and our own number formatting, this is called from
+ * signal handlers. Lines are "sec.usec level: message".
+ */
+void af_log_flight_dump( int fd )
+{
+	af_log_flight_t  *fl = _af_daemon ? _af_daemon->logs.flight : NULL;
+	af_log_flight_rec_t *rec;
+	unsigned long     next;
+	unsigned long     seq;
+	char              num[32];
+	int               len;
+
+	if ( fl == NULL )
+	{
+		return;
+	}
+
+	next = __atomic_load_n( &fl->next, __ATOMIC_ACQUIRE );
+
+	for ( seq = ( next > fl->size ) ? next - fl->size : 0; seq < next; seq++ )
+	{
+		rec = &fl->rec[seq % fl->size];
+		if ( __atomic_load_n( &rec->seq, __ATOMIC_ACQUIRE ) != seq + 1 )
+		{
+			// Being written, or already overwritten
+			continue;
+		}
+
+		af_log_signal( fd, af_itoa( (int)rec->tv.tv_sec, num, 10 ) );
+		af_itoa( (int)rec->tv.tv_usec + 1000000, num, 10 );
+		num[0] = '.';
+		af_log_signal( fd, num );
+		num[0] = ' ';
+		af_itoa( rec->mask & LOG_PRIMASK, num + 1, 10 );
+		af_log_signal( fd, num );
+		af_log_signal( fd, ": " );
+
+		for ( len = 0; len < sizeof(rec->msg) && rec->msg[len]; len++ )
+			;
+		if ( write( fd, rec->msg, len ) != len )
+		{
+			// Nothing more we can do
+		}
+		af_log_signal( fd, "\n" );
+	}
 }
 
+extern void _af_log_bin_open( void );
+extern void _af_log_bin_write( unsigned int msg_mask, const char *format, va_list ap );
+
 void _af_log_init( void )
 {
-	if ( _af_daemon->use_syslog )
+	if ( !_af_daemon->logs.init )
+	{
+		pthread_mutex_init( &_af_daemon->logs.lock, NULL );
+		_af_daemon->logs.init = 1;
+	}
+
+	if ( _af_daemon->use_syslog && _af_daemon->syslog_native && !_af_daemon->logs.syslog_native )
+	{
+		if ( _af_log_syslog_open( ) < 0 )
+		{
+			// syslog(3) will have to do for now
+			_af_log_syslog_fallback( );
+		}
+	}
+	else if ( _af_daemon->use_syslog )
 	{
 		// open syslog
-		openlog( _af_daemon->log_name, LOG_PID | LOG_NDELAY, LOG_LOCAL7 );
+		openlog( _af_daemon->log_name, LOG_PID | LOG_NDELAY, AF_LOG_SYSLOG_FACILITY );
 	}
 	else
 	{
@@ -66,6 +1060,277 @@ void _af_log_init( void )
 	{
 		af_close_logfile();
 	}
+
+	_af_log_flight_open( );
+
+	if ( _af_daemon->log_bin_filename )
+	{
+		_af_log_bin_open( );
+	}
+
+	// A log file needs the log thread for rotation, even without log_async
+	if ( (_af_daemon->log_async || _af_daemon->log_filename) && !_af_daemon->logs.running )
+	{
+		_af_log_start_thread( );
+	}
+	else if ( !_af_daemon->log_async && !_af_daemon->log_filename && _af_daemon->logs.running )
+	{
+		af_log_stop( );
+	}
+
+	_af_daemon->logs.async = _af_daemon->log_async && _af_daemon->logs.running;
+}
+
+/*
+ * Rate limits and sampling, set with af_log_limit(). There is one entry
+ * per group bit (or no group) and level, each with a token bucket and a
+ * 1-in-N sample count. What they hold back is counted and reported in a
+ * "suppressed" line at most once every AF_LOG_LIMIT_REPORT msec.
+ */
+#define AF_LOG_LIMIT_GROUPS  33          // no group, then a bit each
+#define AF_LOG_LIMIT_LEVELS  (LOG_DEBUG + 1)
+#define AF_LOG_LIMIT_REPORT  5000
+
+typedef struct _af_log_limit_ent_s
+{
+	int               rate;        // messages/sec, 0 no limit
+	int               burst;       // bucket size in messages
+	int               sample;      // keep 1 in sample, 0 or 1 keep all
+	int64_t           tokens;      // in 1/1000 of a message
+	int64_t           last;        // msec of the last refill
+	unsigned long     seen;        // for sampling
+	unsigned long     suppressed;  // since the last report
+	int64_t           reported;    // msec of the last report
+} af_log_limit_ent_t;
+
+typedef struct _af_log_limit_s
+{
+	pthread_mutex_t   lock;
+	int               pending;     // entries with a suppressed count
+	pthread_t         owner;       // called af_log_limit(), report runs on its poll
+	af_timer_t        report;      // reports counts left when a flood stops, no log thread
+	af_log_limit_ent_t ent[AF_LOG_LIMIT_GROUPS][AF_LOG_LIMIT_LEVELS];
+} af_log_limit_t;
+
+void _af_vlog_write( unsigned int msg_mask, const char *format, va_list ap );
+void _af_log_writef( unsigned int msg_mask, const char *format, ... ) __attribute__((format(printf, 2,3)));
+void _af_log_limit_timer( af_timer_t *timer );
+
+int64_t _af_log_limit_msec( void )
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+#else
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+#endif
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Limit messages of the groups in mask, at the level in mask and every
+ * less severe level. rate is messages/sec with bursts of up to burst
+ * (0 means rate), sample keeps 1 in that many. A rate of 0 and sample of
+ * 0 removes the limit. Groups of 0 limits messages logged without one.
+ */
+int af_log_limit( unsigned int mask, int rate, int burst, int sample )
+{
+	af_log_control_t *lc = &_af_daemon->logs;
+	af_log_limit_t   *ll;
+	af_log_limit_ent_t *ent;
+	unsigned int      groups = mask & ~LOG_PRIMASK;
+	int               level;
+	int               g;
+
+	if ( ( ll = lc->limits ) == NULL )
+	{
+		if ( ( ll = calloc( 1, sizeof(af_log_limit_t) ) ) == NULL )
+		{
+			af_log_print( LOG_ERR, "%s: no memory for log limits", __func__ );
+			return -1;
+		}
+		pthread_mutex_init( &ll->lock, NULL );
+		__atomic_store_n( &lc->limits, ll, __ATOMIC_RELEASE );
+
+		// Armed on the caller's poll while counts are pending, af_log_flush()
+		// at exit catches what other threads held back
+		ll->owner = pthread_self( );
+		ll->report.sec = AF_LOG_LIMIT_REPORT / 1000;
+		ll->report.slack = 1000;
+		ll->report.callback = _af_log_limit_timer;
+		atexit( af_log_flush );
+	}
+
+	pthread_mutex_lock( &ll->lock );
+
+	for ( g = 0; g < AF_LOG_LIMIT_GROUPS; g++ )
+	{
+		if ( g ? !(groups & (1U << (g - 1))) : (groups != 0) )
+		{
+			continue;
+		}
+
+		for ( level = mask & LOG_PRIMASK; level < AF_LOG_LIMIT_LEVELS; level++ )
+		{
+			ent = &ll->ent[g][level];
+			ent->rate = rate;
+			ent->burst = ( burst > 0 ) ? burst : rate;
+			ent->sample = sample;
+			ent->tokens = (int64_t)ent->burst * 1000;
+			ent->last = _af_log_limit_msec( );
+			ent->seen = 0;
+		}
+	}
+
+	pthread_mutex_unlock( &ll->lock );
+
+	return 0;
+}
+
+void _af_log_limit_say( unsigned int msg_mask, unsigned long suppressed )
+{
+	_af_log_writef( msg_mask, "log: %lu messages suppressed (group 0x%x level %d)", 
+					suppressed, msg_mask & ~LOG_PRIMASK, msg_mask & LOG_PRIMASK );
+}
+
+/* Returns 1 if the message should be dropped */
+int _af_log_limit_check( af_log_limit_t *ll, unsigned int msg_mask )
+{
+	af_log_limit_ent_t *ent;
+	unsigned long     suppressed = 0;
+	int64_t           now;
+	int               drop = 0;
+	int               arm = 0;
+
+	ent = &ll->ent[ffs( msg_mask & ~LOG_PRIMASK )][msg_mask & LOG_PRIMASK];
+
+	if ( !ent->rate && ent->sample <= 1 && !ent->suppressed )
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock( &ll->lock );
+
+	now = _af_log_limit_msec( );
+
+	if ( ent->sample > 1 && (ent->seen++ % ent->sample) != 0 )
+	{
+		drop = 1;
+	}
+	else if ( ent->rate )
+	{
+		ent->tokens += (now - ent->last) * ent->rate;
+		if ( ent->tokens > (int64_t)ent->burst * 1000 )
+		{
+			ent->tokens = (int64_t)ent->burst * 1000;
+		}
+		ent->last = now;
+
+		if ( ent->tokens >= 1000 )
+		{
+			ent->tokens -= 1000;
+		}
+		else
+		{
+			drop = 1;
+		}
+	}
+
+	if ( drop && ent->suppressed++ == 0 )
+	{
+		ll->pending++;
+		arm = 1;
+	}
+
+	if ( ent->suppressed && (now - ent->reported >= AF_LOG_LIMIT_REPORT) )
+	{
+		suppressed = ent->suppressed;
+		ent->suppressed = 0;
+		ent->reported = now;
+		ll->pending--;
+		arm = 0;
+	}
+
+	pthread_mutex_unlock( &ll->lock );
+
+	// The log thread reports when there is one, timers belong to their thread
+	if ( arm && !_af_daemon->logs.running &&
+		 pthread_equal( pthread_self( ), ll->owner ) && !ll->report.running )
+	{
+		af_timer_start( &ll->report );
+	}
+
+	if ( suppressed )
+	{
+		_af_log_limit_say( msg_mask, suppressed );
+	}
+
+	return drop;
+}
+
+/*
+ * Report what's been suppressed since the last report, for entries whose
+ * AF_LOG_LIMIT_REPORT is up, or all of them with force. The check above
+ * only reports when another message comes along. Called by the log
+ * thread, or the report timer when there isn't one.
+ */
+void _af_log_limit_report( int force )
+{
+	af_log_limit_t   *ll = __atomic_load_n( &_af_daemon->logs.limits, __ATOMIC_ACQUIRE );
+	af_log_limit_ent_t *ent;
+	unsigned long     suppressed;
+	int64_t           now;
+	int               g, level;
+
+	if ( ll == NULL || !__atomic_load_n( &ll->pending, __ATOMIC_RELAXED ) )
+	{
+		return;
+	}
+
+	now = _af_log_limit_msec( );
+
+	for ( g = 0; g < AF_LOG_LIMIT_GROUPS; g++ )
+	{
+		for ( level = 0; level < AF_LOG_LIMIT_LEVELS; level++ )
+		{
+			ent = &ll->ent[g][level];
+			if ( !ent->suppressed )
+			{
+				continue;
+			}
+
+			pthread_mutex_lock( &ll->lock );
+			suppressed = 0;
+			if ( ent->suppressed && (force || now - ent->reported >= AF_LOG_LIMIT_REPORT) )
+			{
+				suppressed = ent->suppressed;
+				ent->suppressed = 0;
+				ent->reported = now;
+				ll->pending--;
+			}
+			pthread_mutex_unlock( &ll->lock );
+
+			if ( suppressed )
+			{
+				_af_log_limit_say( ( g ? 1U << (g - 1) : 0 ) | level, suppressed );
+			}
+		}
+	}
+}
+
+void _af_log_limit_timer( af_timer_t *timer )
+{
+	af_log_limit_t   *ll = _af_daemon->logs.limits;
+
+	_af_log_limit_report( 0 );
+
+	// Until everything held back has been reported
+	if ( __atomic_load_n( &ll->pending, __ATOMIC_RELAXED ) && !_af_daemon->logs.running )
+	{
+		af_timer_start( timer );
+	}
 }
 
 void af_vlog_print( 
@@ -73,10 +1338,16 @@ void af_vlog_print(
 	const char *format, 
 	va_list ap )
 {
-	FILE *fh;
+	af_log_limit_t *ll;
+	af_log_flight_t *fl;
 	unsigned int log_level = msg_mask & LOG_PRIMASK;
 	unsigned int log_mask = msg_mask & ~LOG_PRIMASK;
 
+	if ( ( fl = _af_daemon->logs.flight ) != NULL && (int)log_level <= _af_daemon->logs.flight_level )
+	{
+		_af_log_flight_record( fl, msg_mask, format, ap );
+	}
+
 	// check group != 0 and mask = 0 don't log
 	if ( log_mask && ((log_mask & _af_daemon->log_mask) == 0) )
 	{
@@ -90,7 +1361,52 @@ void af_vlog_print(
 		return;
 	}
 
-	if ( _af_daemon->use_syslog )
+	if ( ( ll = __atomic_load_n( &_af_daemon->logs.limits, __ATOMIC_ACQUIRE ) ) != NULL )
+	{
+		if ( _af_log_limit_check( ll, msg_mask ) )
+		{
+			return;
+		}
+	}
+
+	_af_vlog_write( msg_mask, format, ap );
+}
+
+/* Write a message out, it already passed the filters */
+void _af_vlog_write( unsigned int msg_mask, const char *format, va_list ap )
+{
+	FILE *fh;
+	unsigned int log_level = msg_mask & LOG_PRIMASK;
+
+	if ( _af_daemon->logs.bin )
+	{
+		// Binary log takes the place of the text log
+		_af_log_bin_write( msg_mask, format, ap );
+	}
+	else if ( _af_daemon->logs.async )
+	{
+		if ( _af_log_queue( msg_mask, format, ap ) == 0 )
+		{
+			return;
+		}
+	}
+
+	if ( _af_daemon->use_syslog && _af_daemon->syslog_native && !_af_daemon->logs.syslog_native &&
+		 time( NULL ) >= _af_daemon->logs.syslog_retry )
+	{
+		pthread_mutex_lock( &_af_daemon->logs.lock );
+		_af_log_syslog_retry( );
+		pthread_mutex_unlock( &_af_daemon->logs.lock );
+	}
+
+	if ( _af_daemon->use_syslog && _af_daemon->logs.syslog_native )
+	{
+		// The socket is reconnected by whoever finds syslogd gone
+		pthread_mutex_lock( &_af_daemon->logs.lock );
+		_af_log_syslog_vsend( msg_mask, format, ap );
+		pthread_mutex_unlock( &_af_daemon->logs.lock );
+	}
+	else if ( _af_daemon->use_syslog )
 	{
 		va_list nap;
 		va_copy(nap,ap);
@@ -98,6 +1414,19 @@ void af_vlog_print(
 		va_end(nap);
 	}
 
+	if ( _af_daemon->logs.bin )
+	{
+		return;
+	}
+
+	// Other threads log inline too, and rotation closes log_fh under the lock
+	pthread_mutex_lock( &_af_daemon->logs.lock );
+
+	if ( _af_log_rotate_due( ) )
+	{
+		_af_log_maintain_kick( );
+	}
+
 	fh = _af_daemon->log_fh;
 
 	if ( !fh && !_af_daemon->daemonize )
@@ -107,33 +1436,43 @@ void af_vlog_print(
 	if ( fh )
 	{
         struct timeval tv;
-        time_t         curtime;
 		va_list        nap;
-        char           time_buf[64];
+        char           prefix[128];
+        int            len;
 
-        gettimeofday(&tv, NULL); 
-        curtime=tv.tv_sec;
+        _af_log_time( msg_mask, &tv );
 
-        strftime(time_buf, sizeof(time_buf), 
-                 "%m-%d-%Y %T.",
-                 localtime(&curtime));
-
-        fprintf(fh, "%s%06d %s: ",
-                time_buf, (int)tv.tv_usec,
-                _af_daemon->log_name );
+        len = _af_log_prefix( prefix, sizeof(prefix), &tv );
+        fputs( prefix, fh );
 
 		va_copy(nap,ap);
-		vfprintf(fh, format, nap);
+		len += vfprintf(fh, format, nap);
 		va_end(nap);
 
 		fprintf(fh, "\n");
 		fflush( fh );
+
+		if ( fh == _af_daemon->log_fh )
+		{
+			_af_daemon->logs.log_bytes += len + 1;
+		}
 	}
 
+	pthread_mutex_unlock( &_af_daemon->logs.lock );
+
 	return;
 }
 
-void af_log_print( unsigned int msg_mask, const char *format , ...)
+void _af_log_writef( unsigned int msg_mask, const char *format, ... )
+{
+	va_list ap;
+	va_start(ap, format); 
+	_af_vlog_write( msg_mask, format, ap );
+	va_end(ap);
+}
+
+// Parenthesized so the af_log_print() macro in appf.h doesn't expand it
+void (af_log_print)( unsigned int msg_mask, const char *format , ...)
 {
 	va_list ap;
 	va_start(ap, format); 
@@ -149,6 +1488,8 @@ void af_fatal( const char *fmt, ...)
 	af_vlog_print( LOG_EMERG, fmt, pvar );
 	va_end(pvar);
 
+	af_log_flush( );
+
 	if ( _af_daemon->pid_file )
 		unlink( _af_daemon->pid_file );
 	closelog();
@@ -0,0 +1,591 @@
+/*****************************************************************************/
+/*               _____                      _  ______ _____                  */
+/*              /  ___|                    | | | ___ \  __ \                 */
+/*              \ `--. _ __ ___   __ _ _ __| |_| |_/ / |  \/                 */
+/*               `--. \ '_ ` _ \ / _` | '__| __|    /| | __                  */
+/*              /\__/ / | | | | | (_| | |  | |_| |\ \| |_\ \                 */
+/*              \____/|_| |_| |_|\__,_|_|   \__\_| \_|\____/ Inc.            */
+/*                                                                           */
+/*****************************************************************************/
+/*                                                                           */
+/*                       copyright 2016 by SmartRG, Inc.                     */
+/*                              Santa Barbara, CA                            */
+/*                                                                           */
+/*****************************************************************************/
+/*                                                                           */
+/* Author: Colin Whittaker                                                   */
+/*                                                                           */
+/* Purpose: Application Framework Library for building daemons               */
+/*                                                                           */
+/*****************************************************************************/
+
+#include <appf.h>
+#include <sys/mman.h>
+
+/*
+ * Binary log. Instead of formatting, af_log_print() stores the format
+ * string once and then just the raw arguments of each message into a
+ * memory mapped file, so it survives a crash. logdump turns it back into
+ * the same text using af_log_bin_format().
+ *
+ * Formats are looked up by their address, so they should be literals.
+ * One that changed since, or a format we can't take apart (%n, %m, too
+ * many args) is stored as preformatted text instead.
+ */
+#define AF_LOG_BIN_RING     (8 * 1024 * 1024)
+#define AF_LOG_BIN_RING_MIN (64 * 1024)     // has to hold the biggest record
+#define AF_LOG_BIN_FMTS     (1024 * 1024)
+#define AF_LOG_BIN_HASH     4096            // formats we remember, power of 2
+#define AF_LOG_BIN_ARGS     32
+#define AF_LOG_BIN_STR      1024            // longest string argument kept
+#define AF_LOG_BIN_ALIGN(x) (((x) + 7) & ~7)
+
+typedef struct _af_log_spec_s
+{
+	const char       *lit;         // text up to the conversion
+	int               lit_len;
+	const char       *conv;        // the conversion, from the %
+	int               conv_len;
+	int               stars;       // * width/precision ints before the value
+	char              type;        // argument type, 0 if none
+} af_log_spec_t;
+
+typedef struct _af_log_fmt_s
+{
+	const char       *fmt;         // the caller's pointer
+	uint32_t          id;
+	char              types[AF_LOG_BIN_ARGS + 1];
+} af_log_fmt_t;
+
+typedef struct _af_log_bin_s
+{
+	pthread_mutex_t   lock;
+	int               fd;
+	size_t            map_size;
+	af_log_bin_hdr_t *hdr;
+	char             *fmts;
+	unsigned char    *ring;
+	af_log_fmt_t      hash[AF_LOG_BIN_HASH];
+} af_log_bin_t;
+
+extern void _af_log_time( unsigned int msg_mask, struct timeval *tv );
+
+/*
+ * Split off the next conversion. Argument types are
+ *   i int, l long, q long long, z size_t, d double, D long double,
+ *   p pointer, s string, ? something we don't handle
+ * Returns where to carry on, or NULL at the end of the format, where
+ * spec->lit is whatever text is left.
+ */
+const char *_af_log_bin_spec( const char *fmt, af_log_spec_t *spec )
+{
+	const char *p = fmt;
+	char        len = 0;
+
+	memset( spec, 0, sizeof(*spec) );
+	spec->lit = fmt;
+
+	while ( *p && *p != '%' )
+		p++;
+
+	spec->lit_len = p - fmt;
+	if ( *p == '\0' )
+	{
+		return NULL;
+	}
+
+	spec->conv = p++;
+
+	if ( *p == '%' )
+	{
+		// Literal %, the conversion just prints it
+		spec->conv_len = 2;
+		return p + 1;
+	}
+
+	// flags, width, precision
+	while ( *p && strchr( "-+ #0'", *p ) )
+		p++;
+	if ( *p == '*' )
+	{
+		spec->stars++;
+		p++;
+	}
+	while ( isdigit( *p ) )
+		p++;
+	if ( *p == '.' )
+	{
+		p++;
+		if ( *p == '*' )
+		{
+			spec->stars++;
+			p++;
+		}
+		while ( isdigit( *p ) )
+			p++;
+	}
+
+	// length
+	switch ( *p )
+	{
+	case 'h':
+		p++;
+		if ( *p == 'h' )
+			p++;
+		break;
+	case 'l':
+		len = 'l';
+		p++;
+		if ( *p == 'l' )
+		{
+			len = 'q';
+			p++;
+		}
+		break;
+	case 'q':
+	case 'j':
+		len = 'q';
+		p++;
+		break;
+	case 'z':
+	case 't':
+		len = 'z';
+		p++;
+		break;
+	case 'L':
+		len = 'L';
+		p++;
+		break;
+	}
+
+	switch ( *p )
+	{
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+		spec->type = ( len && len != 'L' ) ? len : 'i';
+		break;
+	case 'c':
+		spec->type = 'i';
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		spec->type = ( len == 'L' ) ? 'D' : 'd';
+		break;
+	case 'p':
+		spec->type = 'p';
+		break;
+	case 's':
+		spec->type = ( len == 'l' ) ? '?' : 's';
+		break;
+	default:
+		spec->type = '?';
+		break;
+	}
+
+	if ( *p )
+		p++;
+
+	spec->conv_len = p - spec->conv;
+
+	return p;
+}
+
+/* Argument types of a format, -1 if it can't be stored as a binary record */
+int _af_log_bin_types( const char *fmt, char *types )
+{
+	af_log_spec_t spec;
+	int           n = 0;
+	int           i;
+
+	while ( ( fmt = _af_log_bin_spec( fmt, &spec ) ) != NULL )
+	{
+		if ( spec.type == '?' || n + spec.stars + 1 > AF_LOG_BIN_ARGS )
+		{
+			return -1;
+		}
+		for ( i = 0; i < spec.stars; i++ )
+		{
+			types[n++] = 'i';
+		}
+		if ( spec.type )
+		{
+			types[n++] = spec.type;
+		}
+	}
+	types[n] = '\0';
+
+	return n;
+}
+
+/* Look up, or add, the format. NULL if it has to go as text. */
+af_log_fmt_t *_af_log_bin_fmt( af_log_bin_t *bin, const char *fmt )
+{
+	af_log_fmt_t *f;
+	uint32_t      len;
+	unsigned int  h;
+	int           i;
+
+	h = ((uintptr_t)fmt >> 3) * 2654435761u;
+
+	for ( i = 0; i < AF_LOG_BIN_HASH; i++ )
+	{
+		f = &bin->hash[(h + i) & (AF_LOG_BIN_HASH - 1)];
+
+		if ( f->fmt == fmt )
+		{
+			// Same address, but a buffer may have been reused for another format
+			if ( f->id == AF_LOG_BIN_TEXT || strcmp( bin->fmts + f->id, fmt ) != 0 )
+			{
+				return NULL;
+			}
+			return f;
+		}
+
+		if ( f->fmt == NULL )
+		{
+			f->fmt = fmt;
+			f->id = AF_LOG_BIN_TEXT;
+
+			len = strlen( fmt ) + 1;
+			if ( (_af_log_bin_types( fmt, f->types ) < 0) ||
+				 (bin->hdr->fmt_used + len > bin->hdr->fmt_size) )
+			{
+				return NULL;
+			}
+
+			f->id = bin->hdr->fmt_used;
+			memcpy( bin->fmts + f->id, fmt, len );
+			bin->hdr->fmt_used += len;
+
+			return f;
+		}
+	}
+
+	return NULL;
+}
+
+/* Make room for len bytes at the head, returns where they go */
+unsigned char *_af_log_bin_reserve( af_log_bin_t *bin, uint32_t len )
+{
+	af_log_bin_hdr_t *hdr = bin->hdr;
+	af_log_bin_rec_t *rec;
+	uint64_t          pos = hdr->head % hdr->ring_size;
+	uint64_t          left = hdr->ring_size - pos;
+	uint64_t          head = hdr->head;
+
+	// Doesn't fit before the end, pad it out and wrap
+	if ( left < len )
+	{
+		head += left;
+	}
+
+	// Drop the oldest records we are about to write over
+	while ( head + len - hdr->tail > hdr->ring_size )
+	{
+		rec = (af_log_bin_rec_t *)(bin->ring + hdr->tail % hdr->ring_size);
+		hdr->tail += rec->len;
+	}
+
+	if ( left < len )
+	{
+		rec = (af_log_bin_rec_t *)(bin->ring + pos);
+		rec->len = left;
+		if ( left >= sizeof(af_log_bin_rec_t) )
+		{
+			rec->fmt = AF_LOG_BIN_PAD;
+		}
+		hdr->head = head;
+		pos = 0;
+	}
+
+	return bin->ring + pos;
+}
+
+void _af_log_bin_write( unsigned int msg_mask, const char *format, va_list ap )
+{
+	af_log_bin_t     *bin = _af_daemon->logs.bin;
+	af_log_fmt_t     *f;
+	af_log_bin_rec_t *rec;
+	unsigned char     args[AF_LOG_BIN_ARGS * 8 + AF_LOG_BIN_STR * 2];
+	unsigned char    *ap8 = args;
+	struct timeval    tv;
+	const char       *str;
+	char             *t;
+	va_list           nap;
+	int64_t           i64;
+	double            dbl;
+	uint32_t          slen;
+	uint32_t          len;
+
+	_af_log_time( msg_mask, &tv );
+
+	pthread_mutex_lock( &bin->lock );
+
+	va_copy( nap, ap );
+
+	if ( ( f = _af_log_bin_fmt( bin, format ) ) != NULL )
+	{
+		for ( t = f->types; *t; t++ )
+		{
+			switch ( *t )
+			{
+			case 's':
+				if ( ( str = va_arg( nap, const char * ) ) == NULL )
+					str = "(null)";
+				slen = strnlen( str, AF_LOG_BIN_STR );
+				// Only two strings at full length fit, cut the rest short
+				if ( ap8 + 4 + slen > args + sizeof(args) - (AF_LOG_BIN_ARGS * 8) )
+					slen = 0;
+				memcpy( ap8, &slen, 4 );
+				memcpy( ap8 + 4, str, slen );
+				ap8 += AF_LOG_BIN_ALIGN( 4 + slen );
+				continue;
+			case 'd':
+				dbl = va_arg( nap, double );
+				memcpy( ap8, &dbl, 8 );
+				ap8 += 8;
+				continue;
+			case 'D':
+				dbl = va_arg( nap, long double );
+				memcpy( ap8, &dbl, 8 );
+				ap8 += 8;
+				continue;
+			case 'l':
+				i64 = va_arg( nap, long );
+				break;
+			case 'q':
+				i64 = va_arg( nap, long long );
+				break;
+			case 'z':
+				i64 = va_arg( nap, size_t );
+				break;
+			case 'p':
+				i64 = (intptr_t)va_arg( nap, void * );
+				break;
+			default:
+				i64 = va_arg( nap, int );
+				break;
+			}
+			memcpy( ap8, &i64, 8 );
+			ap8 += 8;
+		}
+	}
+	else
+	{
+		// Format it now, as one string argument
+		slen = vsnprintf( (char *)args + 4, sizeof(args) - 4, format, nap );
+		if ( slen >= sizeof(args) - 4 )
+			slen = sizeof(args) - 5;
+		memcpy( args, &slen, 4 );
+		ap8 += AF_LOG_BIN_ALIGN( 4 + slen );
+	}
+
+	va_end( nap );
+
+	len = sizeof(af_log_bin_rec_t) + (ap8 - args);
+
+	rec = (af_log_bin_rec_t *)_af_log_bin_reserve( bin, len );
+	rec->len = len;
+	rec->fmt = f ? f->id : AF_LOG_BIN_TEXT;
+	rec->mask = msg_mask;
+	rec->usec = tv.tv_usec;
+	rec->sec = tv.tv_sec;
+	memcpy( rec + 1, args, ap8 - args );
+
+	// Readers go by head, so the record has to be complete first
+	__atomic_store_n( &bin->hdr->head, bin->hdr->head + len, __ATOMIC_RELEASE );
+
+	pthread_mutex_unlock( &bin->lock );
+}
+
+/*
+ * Recreate the text of a record from its format and argument bytes, the
+ * same way the format would have printed. Returns the length, like
+ * snprintf().
+ */
+int af_log_bin_format( char *buf, int len, const char *fmt, const void *args, int args_len )
+{
+	const unsigned char *ap8 = args;
+	const unsigned char *end = ap8 + args_len;
+	af_log_spec_t        spec;
+	char                 conv[64];
+	int64_t              val[3];
+	double               dbl;
+	uint32_t             slen;
+	char                 str[AF_LOG_BIN_STR + 1];
+	int                  out = 0;
+	int                  n;
+	int                  i;
+
+#define AF_LOG_BIN_OUT( ... ) \
+	do { \
+		n = snprintf( buf + ((out < len) ? out : 0), (out < len) ? len - out : 0, __VA_ARGS__ ); \
+		out += ( n > 0 ) ? n : 0; \
+	} while ( 0 )
+
+	for ( ; ; )
+	{
+		const char *next = _af_log_bin_spec( fmt, &spec );
+
+		AF_LOG_BIN_OUT( "%.*s", spec.lit_len, spec.lit );
+
+		if ( next == NULL )
+		{
+			break;
+		}
+		fmt = next;
+
+		if ( spec.type == 0 )
+		{
+			AF_LOG_BIN_OUT( "%%" );
+			continue;
+		}
+
+		if ( spec.type == '?' || spec.conv_len >= sizeof(conv) )
+		{
+			AF_LOG_BIN_OUT( "%.*s", spec.conv_len, spec.conv );
+			continue;
+		}
+
+		memcpy( conv, spec.conv, spec.conv_len );
+		conv[spec.conv_len] = '\0';
+
+		for ( i = 0; i < spec.stars; i++ )
+		{
+			val[i] = 0;
+			if ( ap8 + 8 <= end )
+				memcpy( &val[i], ap8, 8 );
+			ap8 += 8;
+		}
+
+		if ( spec.type == 's' )
+		{
+			slen = 0;
+			if ( ap8 + 4 <= end )
+				memcpy( &slen, ap8, 4 );
+			if ( slen > AF_LOG_BIN_STR || ap8 + 4 + slen > end )
+				slen = 0;
+			memcpy( str, ap8 + 4, slen );
+			str[slen] = '\0';
+			ap8 += AF_LOG_BIN_ALIGN( 4 + slen );
+
+			if ( spec.stars == 2 )
+				AF_LOG_BIN_OUT( conv, (int)val[0], (int)val[1], str );
+			else if ( spec.stars == 1 )
+				AF_LOG_BIN_OUT( conv, (int)val[0], str );
+			else
+				AF_LOG_BIN_OUT( conv, str );
+			continue;
+		}
+
+		val[2] = 0;
+		if ( ap8 + 8 <= end )
+			memcpy( &val[2], ap8, 8 );
+		ap8 += 8;
+		memcpy( &dbl, &val[2], 8 );
+
+#define AF_LOG_BIN_ARG( arg ) \
+		do { \
+			if ( spec.stars == 2 ) \
+				AF_LOG_BIN_OUT( conv, (int)val[0], (int)val[1], arg ); \
+			else if ( spec.stars == 1 ) \
+				AF_LOG_BIN_OUT( conv, (int)val[0], arg ); \
+			else \
+				AF_LOG_BIN_OUT( conv, arg ); \
+		} while ( 0 )
+
+		switch ( spec.type )
+		{
+		case 'd':  AF_LOG_BIN_ARG( dbl ); break;
+		case 'D':  AF_LOG_BIN_ARG( (long double)dbl ); break;
+		case 'l':  AF_LOG_BIN_ARG( (long)val[2] ); break;
+		case 'q':  AF_LOG_BIN_ARG( (long long)val[2] ); break;
+		case 'z':  AF_LOG_BIN_ARG( (size_t)val[2] ); break;
+		case 'p':  AF_LOG_BIN_ARG( (void *)(intptr_t)val[2] ); break;
+		default:   AF_LOG_BIN_ARG( (int)val[2] ); break;
+		}
+
+#undef AF_LOG_BIN_ARG
+	}
+
+#undef AF_LOG_BIN_OUT
+
+	return out;
+}
+
+void _af_log_bin_open( void )
+{
+	af_log_bin_t     *bin;
+	af_log_bin_hdr_t *hdr;
+	uint64_t          ring_size;
+	size_t            hdr_size;
+	char              old[PATH_MAX];
+	void             *map;
+	int               fd;
+	int               err;
+
+	if ( _af_daemon->logs.bin )
+	{
+		return;
+	}
+
+	ring_size = AF_LOG_BIN_ALIGN( (uint64_t)(_af_daemon->log_bin_size > 0 ? _af_daemon->log_bin_size : AF_LOG_BIN_RING) );
+	if ( ring_size < AF_LOG_BIN_RING_MIN )
+	{
+		ring_size = AF_LOG_BIN_RING_MIN;
+	}
+	hdr_size = sysconf( _SC_PAGESIZE );
+
+	// Keep the last run's log, it may be why we restarted
+	snprintf( old, sizeof(old), "%s.old", _af_daemon->log_bin_filename );
+	err = errno;
+	rename( _af_daemon->log_bin_filename, old );
+	errno = err;
+
+	if ( ( fd = open( _af_daemon->log_bin_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) < 0 )
+	{
+		af_log_print( LOG_ERR, "Failed to open binary log %s errno %d (%s)", _af_daemon->log_bin_filename, errno, strerror(errno) );
+		return;
+	}
+
+	if ( ftruncate( fd, hdr_size + AF_LOG_BIN_FMTS + ring_size ) < 0 )
+	{
+		af_log_print( LOG_ERR, "Failed to size binary log %s errno %d (%s)", _af_daemon->log_bin_filename, errno, strerror(errno) );
+		close( fd );
+		return;
+	}
+
+	map = mmap( NULL, hdr_size + AF_LOG_BIN_FMTS + ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if ( map == MAP_FAILED )
+	{
+		af_log_print( LOG_ERR, "Failed to map binary log %s errno %d (%s)", _af_daemon->log_bin_filename, errno, strerror(errno) );
+		close( fd );
+		return;
+	}
+
+	if ( ( bin = calloc( 1, sizeof(af_log_bin_t) ) ) == NULL )
+	{
+		munmap( map, hdr_size + AF_LOG_BIN_FMTS + ring_size );
+		close( fd );
+		return;
+	}
+
+	pthread_mutex_init( &bin->lock, NULL );
+	bin->fd = fd;
+	bin->map_size = hdr_size + AF_LOG_BIN_FMTS + ring_size;
+	bin->hdr = hdr = map;
+	bin->fmts = (char *)map + hdr_size;
+	bin->ring = (unsigned char *)map + hdr_size + AF_LOG_BIN_FMTS;
+
+	hdr->hdr_size = sizeof(af_log_bin_hdr_t);
+	hdr->fmt_off = hdr_size;
+	hdr->fmt_size = AF_LOG_BIN_FMTS;
+	hdr->fmt_used = 0;
+	hdr->ring_off = hdr_size + AF_LOG_BIN_FMTS;
+	hdr->ring_size = ring_size;
+	hdr->head = 0;
+	hdr->tail = 0;
+	strncpy( hdr->name, _af_daemon->log_name ? _af_daemon->log_name : "", sizeof(hdr->name) - 1 );
+	// Last, a reader only trusts the rest once it sees this
+	memcpy( hdr->magic, AF_LOG_BIN_MAGIC, sizeof(hdr->magic) );
+
+	_af_daemon->logs.bin = bin;
+}
@@ -151,6 +151,11 @@ void af_seg_fault_handler (int signo, siginfo_t* p_siginfo, void* dummy3)
 			}
 		}
 #endif
+		if ( _af_daemon && _af_daemon->logs.flight )
+		{
+			af_log_signal( fd, "Flight recorder.....\n" );
+			af_log_flight_dump( fd );
+		}
 		close(fd);
 	}
 
@@ -339,6 +344,7 @@ int _af_write_pid( void )
 }
 
 extern void _af_log_init( void );
+extern void _af_poll_init( void );
 
 int af_daemon_start( void )
 {
@@ -358,11 +364,12 @@ int af_daemon_start( void )
 		_af_daemonize( );
 	}
 
-	_af_daemon->timers.fd = -1;
-
 	// setup logging
 	_af_log_init( );
 
+	// setup poll dispatch, after daemonizing closed our fds
+	_af_poll_init( );
+
 	// Create PID file
 	return _af_write_pid( );
 }
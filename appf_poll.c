@@ -21,49 +21,250 @@
 
 #include <appf.h>
 
-#define		MAX_FDS      256
+#if defined(__linux__) && !defined(AF_NO_EPOLL)
+#include <sys/epoll.h>
+#define AF_HAVE_EPOLL       1
+#endif
 
-int af_poll_run( int timeout )
+extern int _af_timer_poll_timeout( void );
+extern int _af_timer_fds( void );
+
+#define		MIN_FDS      64     // initial registry size
+#define		MAX_EVENTS   64     // ready events handled per epoll_wait()
+
+/* epoll user data carries the fd and the generation it was registered with */
+#define		EV_DATA( fd, gen )   (((uint64_t)(gen) << 32) | (uint32_t)(fd))
+#define		EV_FD( data )        ((int)(uint32_t)(data))
+#define		EV_GEN( data )       ((unsigned int)((data) >> 32))
+
+// Server reactor threads run their own poll, everyone else the daemon's
+__thread af_poll_control_t *_af_poll_thread;
+
+af_poll_control_t *_af_poll_control( void )
+{
+	return _af_poll_thread ? _af_poll_thread : &_af_daemon->polls;
+}
+
+void _af_poll_init( void )
+{
+	af_poll_control_t *pc = _af_poll_control( );
+
+	if ( pc->init )
+	{
+		return;
+	}
+
+	pc->init = TRUE;
+	pc->engine = AF_POLL_POLL;
+	pc->fd = -1;
+
+#ifdef AF_HAVE_EPOLL
+	if ( _af_daemon->poll_engine == AF_POLL_EPOLL )
+	{
+		// epoll_create() rather than epoll_create1() to keep older glibc happy.
+		pc->fd = epoll_create( MAX_EVENTS );
+		if ( pc->fd < 0 )
+		{
+			af_log_print( LOG_WARNING, "%s: epoll_create() failed errno=%d (%s), using poll()",
+						  __func__, errno, strerror(errno) );
+			return;
+		}
+		if ( fcntl( pc->fd, F_SETFD, FD_CLOEXEC ) != 0 )
+		{
+			af_log_print( LOG_WARNING, "%s: fcntl(F_SETFD, FD_CLOEXEC) failed for fd=%d errno=%d (%s)",
+						  __func__, pc->fd, errno, strerror(errno) );
+		}
+		pc->engine = AF_POLL_EPOLL;
+	}
+#endif
+
+	af_log_print( APPF_MASK_MAIN+LOG_INFO, "Poll engine %s", 
+				  (pc->engine == AF_POLL_EPOLL) ? "epoll" : "poll" );
+}
+
+af_poll_t *_af_poll_find( int fd )
+{
+	af_poll_control_t *pc = _af_poll_control( );
+
+	if ( (fd < 0) || (fd >= pc->size) )
+	{
+		return NULL;
+	}
+
+	return pc->table[fd];
+}
+
+/* Grow the fd registry so it can index fd. */
+int _af_poll_grow_table( int fd )
+{
+	af_poll_control_t *pc = _af_poll_control( );
+	af_poll_t        **table;
+	int                size;
+
+	size = pc->size ? pc->size : MIN_FDS;
+	while ( size <= fd )
+	{
+		size *= 2;
+	}
+
+	table = realloc( pc->table, size * sizeof(af_poll_t *) );
+	if ( table == NULL )
+	{
+		return -1;
+	}
+	memset( &table[pc->size], 0, (size - pc->size) * sizeof(af_poll_t *) );
+
+	pc->table = table;
+	pc->size = size;
+
+	return 0;
+}
+
+/* Grow the poll(2) set by one entry if it's full. */
+int _af_poll_grow_pfds( void )
 {
-	int           ret;
-	int           numfds, idx;
-	struct pollfd pfds[MAX_FDS];
-	af_poll_t     apfds[MAX_FDS];
-	af_poll_t    *ppfd;
+	af_poll_control_t *pc = _af_poll_control( );
+	struct pollfd     *pfds;
+	af_poll_t        **pents;
+	int                size;
 
-	if ( _af_daemon->poll_head == NULL )
+	if ( pc->count < pc->pfds_size )
 	{
 		return 0;
 	}
 
-	numfds = 0;
-	ppfd = _af_daemon->poll_head;
-	while ( ppfd && (numfds < MAX_FDS) )
+	size = pc->pfds_size ? pc->pfds_size * 2 : MIN_FDS;
+
+	pfds = realloc( pc->pfds, size * sizeof(struct pollfd) );
+	if ( pfds == NULL )
+	{
+		return -1;
+	}
+	pc->pfds = pfds;
+
+	pents = realloc( pc->pents, size * sizeof(af_poll_t *) );
+	if ( pents == NULL )
+	{
+		return -1;
+	}
+	pc->pents = pents;
+
+	pc->pfds_size = size;
+
+	return 0;
+}
+
+#ifdef AF_HAVE_EPOLL
+int _af_poll_run_epoll( int timeout )
+{
+	int                 ret, idx;
+	struct epoll_event  evs[MAX_EVENTS];
+	af_poll_t          *pap;
+
+	// Only the ready fds come back, nothing to rebuild.
+	ret = epoll_wait( _af_poll_control( )->fd, evs, MAX_EVENTS, timeout );
+
+	for ( idx = 0; idx < ret; idx++ )
 	{
-		pfds[numfds].fd = ppfd->fd;
-		pfds[numfds].events = ppfd->events;
-		apfds[numfds] = *ppfd;
+		// An earlier callback may have removed this fd, or removed it and
+		// registered the same fd number again.
+		pap = _af_poll_find( EV_FD( evs[idx].data.u64 ) );
+		if ( (pap == NULL) || (pap->gen != EV_GEN( evs[idx].data.u64 )) )
+		{
+			continue;
+		}
 
-		numfds++;
-		ppfd = ppfd->next;
+		// Callback. EPOLL* and POLL* event bits are the same on linux.
+		pap->revents = evs[idx].events;
+		pap->callback( pap );
 	}
 
-	// Main poll
-	ret = poll( pfds, numfds, timeout );
+	return ret;
+}
+#endif
+
+int _af_poll_run_poll( int timeout )
+{
+	af_poll_control_t *pc = _af_poll_control( );
+	int                ret;
+	int                idx;
+	af_poll_t         *pap;
+
+	// Main poll, the set is kept up to date by add/rem.
+	ret = poll( pc->pfds, pc->count, timeout );
 
 	if ( ret > 0 )
 	{
-		for ( idx = 0; (idx < numfds); idx++ )
+		// Callbacks may add or remove fds, so recheck count every pass.
+		// A removal moves the last entry down, it will be seen next poll
+		// if it lands behind us. New fds start with no revents.
+		for ( idx = 0; (idx < pc->count); idx++ )
 		{
 			// check for events
-			if ( pfds[idx].revents )
+			if ( pc->pfds[idx].revents )
 			{
 				// Callback
-				apfds[idx].revents = pfds[idx].revents;
-				apfds[idx].callback( &apfds[idx] );
+				pap = pc->pents[idx];
+				pap->revents = pc->pfds[idx].revents;
+				pc->pfds[idx].revents = 0;
+				pap->callback( pap );
 			}
 		}
 	}
+
+	return ret;
+}
+
+int af_poll_run( int timeout )
+{
+	af_poll_control_t *pc = _af_poll_control( );
+	af_poll_t         *pap;
+	int                ret;
+	int                tmo;
+
+	_af_poll_init( );
+
+	// Don't sleep past the first timer, and don't wake up for nothing
+	tmo = _af_timer_poll_timeout( );
+	if ( (tmo >= 0) && ((timeout < 0) || (tmo < timeout)) )
+	{
+		timeout = tmo;
+	}
+
+	// The timerfd alone is nothing to wait for
+	if ( (pc->count - _af_timer_fds( ) == 0) && (af_timer_next_timeout( ) < 0) )
+	{
+		return 0;
+	}
+
+	// Callbacks get the registration itself, anything removed while
+	// dispatching stays allocated until every callback has returned.
+	pc->running++;
+
+#ifdef AF_HAVE_EPOLL
+	if ( pc->engine == AF_POLL_EPOLL )
+	{
+		ret = _af_poll_run_epoll( timeout );
+	}
+	else
+#endif
+	{
+		ret = _af_poll_run_poll( timeout );
+	}
+
+	// Timers run after the I/O callbacks
+	af_timer_check( );
+
+	if ( --pc->running == 0 )
+	{
+		while ( pc->dead )
+		{
+			pap = pc->dead;
+			pc->dead = pap->next;
+			free( pap );
+		}
+	}
+
 	if ( ret < 0 )
 	{
 		// check for signal
@@ -81,76 +282,270 @@ int af_poll_run( int timeout )
 	return ret;
 }
 
-int af_poll_add( int fd, int events, void (*callback)(af_poll_t *), void *ctx )
+/*
+ * Register fd with pap as its registration.  pap is NULL for af_poll_add(),
+ * which mallocs one, or caller owned storage such as a pooled server
+ * connection's, which af_poll_rem() leaves alone.
+ */
+int _af_poll_attach( af_poll_t *reg, int fd, int events, void (*callback)(af_poll_t *), void *ctx )
 {
-	int        cnt = 0;
-	af_poll_t *pap;
+	af_poll_control_t *pc = _af_poll_control( );
+	af_poll_t         *pap = reg;
 
-	pap = _af_daemon->poll_head;
-	while ( pap )
+	_af_poll_init( );
+
+	if ( fd < 0 )
 	{
-		if ( pap->fd == fd )
-		{
-			af_log_print( APPF_MASK_MAIN+LOG_INFO, "Add poll fd %d, Already on the list", 
-						  fd );
-			return -2;
-		}
-		cnt++;
-		pap = pap->next;
+		af_log_print( LOG_WARNING, "Add poll fd %d, Failed. Invalid fd.", fd );
+		return -1;
+	}
+
+	if ( _af_poll_find( fd ) )
+	{
+		af_log_print( APPF_MASK_MAIN+LOG_INFO, "Add poll fd %d, Already on the list", 
+					  fd );
+		return -2;
+	}
+
+	if ( (fd >= pc->size) && (_af_poll_grow_table( fd ) != 0) )
+	{
+		af_log_print( LOG_WARNING, "Add poll fd %d, Failed. No memory for fd registry.", fd );
+		return -1;
 	}
 
-	if ( cnt >= MAX_FDS )
+	if ( (pc->engine == AF_POLL_POLL) && (_af_poll_grow_pfds( ) != 0) )
 	{
-		af_log_print( LOG_WARNING, "Add poll fd %d, Failed. Too MANY fds %d.", 
-					  fd, MAX_FDS );
+		af_log_print( LOG_WARNING, "Add poll fd %d, Failed. No memory for %d fds.", 
+					  fd, pc->count+1 );
 		return -1;
 	}
 
-	// Make a new one and add it to the list
-	pap = malloc( sizeof( af_poll_t ) );
+	// Make a new one and add it to the registry
+	if ( pap == NULL && ( pap = malloc( sizeof( af_poll_t ) ) ) == NULL )
+	{
+		af_log_print( LOG_WARNING, "Add poll fd %d, Failed. No memory.", fd );
+		return -1;
+	}
 
+	// Never hand out generation 0
+	if ( ++pc->gen == 0 )
+	{
+		pc->gen++;
+	}
+
+	pap->next = NULL;
 	pap->fd = fd;
 	pap->events = events;
+	pap->revents = 0;
 	pap->callback = callback;
 	pap->context = ctx;
+	pap->gen = pc->gen;
+	pap->idx = -1;
+	pap->embedded = ( reg != NULL );
+
+#ifdef AF_HAVE_EPOLL
+	if ( pc->engine == AF_POLL_EPOLL )
+	{
+		struct epoll_event ev;
+
+		// Registered once, the kernel keeps the interest list.
+		memset( &ev, 0, sizeof(ev) );
+		ev.events = events;
+		ev.data.u64 = EV_DATA( fd, pap->gen );
+
+		if ( epoll_ctl( pc->fd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+		{
+			af_log_print( LOG_ERR, "Add poll fd %d, epoll_ctl() failed errno=%d (%s)", 
+						  fd, errno, strerror(errno) );
+			if ( reg == NULL )
+				free( pap );
+			return -1;
+		}
+	}
+	else
+#endif
+	{
+		// Append to the poll(2) set
+		pap->idx = pc->count;
+		pc->pfds[pap->idx].fd = fd;
+		pc->pfds[pap->idx].events = events;
+		pc->pfds[pap->idx].revents = 0;
+		pc->pents[pap->idx] = pap;
+	}
+
+	pc->table[fd] = pap;
+	pc->count++;
+
+	return 0;
+}
+
+int af_poll_add( int fd, int events, void (*callback)(af_poll_t *), void *ctx )
+{
+	return _af_poll_attach( NULL, fd, events, callback, ctx );
+}
+
+int _af_poll_set_events( af_poll_t *pap, int events )
+{
+	af_poll_control_t *pc = _af_poll_control( );
+
+	if ( events == pap->events )
+	{
+		return 0;
+	}
+
+#ifdef AF_HAVE_EPOLL
+	if ( pc->engine == AF_POLL_EPOLL )
+	{
+		struct epoll_event ev;
+
+		memset( &ev, 0, sizeof(ev) );
+		ev.events = events;
+		ev.data.u64 = EV_DATA( pap->fd, pap->gen );
+
+		if ( epoll_ctl( pc->fd, EPOLL_CTL_MOD, pap->fd, &ev ) < 0 )
+		{
+			af_log_print( LOG_ERR, "Modify poll fd %d, epoll_ctl() failed errno=%d (%s)", 
+						  pap->fd, errno, strerror(errno) );
+			return -1;
+		}
+	}
+	else
+#endif
+	{
+		pc->pfds[pap->idx].events = events;
+	}
 
-	// Add it to the head of the list
-	pap->next = _af_daemon->poll_head;
-    _af_daemon->poll_head = pap;
+	pap->events = events;
 
 	return 0;
 }
 
+int af_poll_modify( int fd, int events )
+{
+	af_poll_t *pap;
+
+	if ( ( pap = _af_poll_find( fd ) ) == NULL )
+	{
+		af_log_print( APPF_MASK_MAIN+LOG_INFO, "Modify poll fd %d, Not on the list", fd );
+		return -1;
+	}
+
+	return _af_poll_set_events( pap, events );
+}
+
+int af_poll_enable( int fd, int events )
+{
+	af_poll_t *pap;
+
+	if ( ( pap = _af_poll_find( fd ) ) == NULL )
+	{
+		af_log_print( APPF_MASK_MAIN+LOG_INFO, "Enable poll fd %d, Not on the list", fd );
+		return -1;
+	}
+
+	return _af_poll_set_events( pap, pap->events | events );
+}
+
+int af_poll_disable( int fd, int events )
+{
+	af_poll_t *pap;
+
+	if ( ( pap = _af_poll_find( fd ) ) == NULL )
+	{
+		af_log_print( APPF_MASK_MAIN+LOG_INFO, "Disable poll fd %d, Not on the list", fd );
+		return -1;
+	}
+
+	return _af_poll_set_events( pap, pap->events & ~events );
+}
+
 void af_poll_rem( int fd )
 {
-	af_poll_t    *pap, *nap;
-
-	pap = _af_daemon->poll_head;
-
-	// list is not empty
-	if ( pap )
-    {
-    	if ( _af_daemon->poll_head->fd == fd )
-    	{
-    		_af_daemon->poll_head = _af_daemon->poll_head->next;
-    		free( pap );
-    	}
-    	else
-    	{
-    		while( pap )
-    		{
-    			nap = pap->next;
-    
-    			if ( nap && (nap->fd == fd) )
-    			{
-    				pap->next = nap->next;
-    				free( nap );
-    				break;
-    			}
-    			pap = nap;
-    		}
-    	}
-    }
+	af_poll_control_t *pc = _af_poll_control( );
+	af_poll_t         *pap;
+	int                last;
+
+	if ( ( pap = _af_poll_find( fd ) ) == NULL )
+	{
+		return;
+	}
+
+	pc->table[fd] = NULL;
+	pc->count--;
+
+#ifdef AF_HAVE_EPOLL
+	if ( pc->engine == AF_POLL_EPOLL )
+	{
+		// fd may already be closed, that's fine.
+		epoll_ctl( pc->fd, EPOLL_CTL_DEL, fd, NULL );
+	}
+	else
+#endif
+	{
+		// Move the last entry of the poll(2) set into the hole
+		last = pc->count;
+		if ( pap->idx != last )
+		{
+			pc->pfds[pap->idx] = pc->pfds[last];
+			pc->pents[pap->idx] = pc->pents[last];
+			pc->pents[pap->idx]->idx = pap->idx;
+		}
+		pap->idx = -1;
+	}
+
+	if ( pap->embedded )
+	{
+		// The owner keeps it, a stale event is caught by the generation
+		return;
+	}
+
+	if ( pc->running )
+	{
+		// Still may be referenced by the dispatch loop
+		pap->next = pc->dead;
+		pc->dead = pap;
+	}
+	else
+	{
+		free( pap );
+	}
 }
 
+/* Release this thread's poll, when a reactor thread exits. */
+void _af_poll_free( void )
+{
+	af_poll_control_t *pc = _af_poll_control( );
+	af_poll_t         *pap;
+	int                fd;
+
+	if ( !pc->init )
+	{
+		return;
+	}
+
+	for ( fd = 0; fd < pc->size; fd++ )
+	{
+		if ( pc->table[fd] && !pc->table[fd]->embedded )
+		{
+			free( pc->table[fd] );
+		}
+	}
 
+	while ( pc->dead )
+	{
+		pap = pc->dead;
+		pc->dead = pap->next;
+		free( pap );
+	}
+
+	if ( pc->fd >= 0 )
+	{
+		close( pc->fd );
+	}
+
+	free( pc->table );
+	free( pc->pfds );
+	free( pc->pents );
+
+	memset( pc, 0, sizeof(*pc) );
+}
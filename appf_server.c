@@ -19,9 +19,23 @@
 /*                                                                           */
 /*****************************************************************************/
 
+#define _GNU_SOURCE                 // fopencookie()
 #include <appf.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stddef.h>
 
 void _af_server_handle_new_connection( af_poll_t *ap );
+int _af_server_reactors_start( af_server_t *server );
+void _af_server_reactors_stop( af_server_t *server );
+int _af_server_reactor_post( af_server_reactor_t *r, int req, af_server_shared_t *sh );
+
+extern __thread af_server_reactor_t *_af_server_reactor_self;
+extern __thread af_poll_control_t *_af_poll_thread;
+extern __thread af_timer_control_t *_af_timer_thread;
+extern void _af_poll_free( void );
+extern int _af_poll_attach( af_poll_t *reg, int fd, int events, void (*callback)(af_poll_t *), void *ctx );
+extern void _af_timer_free( void );
 
 int af_server_get_port( const char *service )
 {
@@ -84,20 +98,12 @@ int af_server_set_sockopts( int s, int server_sock )
 	int              val;
 	struct linger    ling;
 
-	/* set closexec so children don't close our sockets */
-	if ( fcntl( s, F_SETFD, FD_CLOEXEC ) != 0 )
-	{
-		/* complain but don't fail */
-		af_log_print( LOG_WARNING, "%s: fcntl(F_SETFD, FD_CLOEXEC) failed for fd=%d errno=%d (%s)",
-			__func__, s, errno, strerror(errno) );
-	}
+	/* close on exec is set by socket() and accept4() */
 
 	/* set nodelay to not buffer and send immediately. */
 	val = 1;
 	if ( setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val) ) < 0 )
 	{
-        close( s );
-
 		af_log_print( LOG_ERR, "%s: setsockopt(TCP_NODELAY) failed for fd=%d errno=%d (%s)",
 			__func__, s, errno, strerror(errno) );
 
@@ -110,8 +116,6 @@ int af_server_set_sockopts( int s, int server_sock )
 		val = 1;
 		if ( setsockopt( s, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val) ) < 0 ) 
 		{
-			close( s );
-
 			af_log_print( LOG_ERR, "%s: setsockopt(SO_REUSEADDR) failed for fd=%d errno=%d (%s)",
 				__func__, s, errno, strerror(errno) );
 
@@ -120,9 +124,10 @@ int af_server_set_sockopts( int s, int server_sock )
 	}
 	else
 	{
-		/* set to non-blocking so close doesn't linger. */
-		ling.l_onoff = 1;
-		ling.l_linger = 2;
+		/* close doesn't linger, linux blocks even non-blocking sockets
+		   until the FIN is acked. The kernel still sends what's left. */
+		ling.l_onoff = 0;
+		ling.l_linger = 0;
 		if ( setsockopt( s, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling) ) != 0 )
 		{
 			af_log_print( LOG_ERR, "%s: setsockopt(SO_LINGER) failed for fd=%d errno=%d (%s)",
@@ -135,346 +140,1661 @@ int af_server_set_sockopts( int s, int server_sock )
 	return 0;
 }
 
-af_server_cnx_t *_af_server_add_connection( af_server_t *server )
+/*
+ * Output queue
+ *
+ * Everything written to a connection, through cnx->fh or af_server_write(),
+ * is appended to a chain of segments and written with a non-blocking
+ * writev().  Whatever the socket doesn't take stays queued and POLLOUT is
+ * enabled until it drains, so a slow client never stalls the daemon.
+ */
+size_t _af_server_out_high( af_server_t *server )
+{
+	return server->out_high ? server->out_high : AF_SERVER_OUT_HIGH;
+}
+
+size_t _af_server_out_max( af_server_t *server )
 {
-	int                 s, fd_dup;
-	af_server_cnx_t    *cnx = NULL;
-	struct sockaddr_in  raddr;
-    socklen_t           rlen;
+	return server->out_max ? server->out_max : _af_server_out_high( server ) * 16;
+}
+
+size_t _af_server_out_low( af_server_t *server )
+{
+	return server->out_low ? server->out_low : _af_server_out_high( server ) / 4;
+}
 
-	s = accept( server->fd, NULL, NULL );
+void _af_server_out_blocked( af_server_cnx_t *cnx, int blocked )
+{
+	af_server_t *server = cnx->server;
+
+	cnx->out_blocked = blocked;
+
+	// Stop reading commands while the client isn't reading replies.
+	// Commands already buffered are run from the next POLLOUT.
+	if ( blocked )
+		af_poll_disable( cnx->fd, POLLIN );
+	else
+		af_poll_enable( cnx->fd, cnx->in_len ? POLLIN|POLLOUT : POLLIN );
 
-	if ( s < 0 ) 
+	af_log_print( APPF_MASK_SERVER+LOG_DEBUG, "client fd %d output %s, %zu bytes queued",
+		cnx->fd, blocked ? "blocked" : "unblocked", cnx->out_bytes );
+
+	if ( server->backpressure_callback )
 	{
-		af_log_print(LOG_ERR, "%s: accept() failed (%d) %s",\
-			__func__, errno, strerror(errno) );
-		return NULL;
+		server->backpressure_callback( cnx, blocked );
 	}
+}
 
-	/* quick check to deny before scanning list */
-	if ( server->num_cnx >= server->max_cnx )
-	{
-		close( s );
-		af_log_print(LOG_ERR, "%s: rejecting new client connection: max number of sessions (%d) already open",\
-			__func__, server->max_cnx );
+/*
+ * Broadcast data is copied once into a shared buffer, each connection's
+ * queue only points at it.  The last reference frees it, references are
+ * dropped on reactor threads too.
+ */
+struct _af_server_shared_s
+{
+	int                      refs;
+	size_t                   len;
+	char                     data[];
+};
 
-		return NULL;
+void _af_server_shared_put( af_server_shared_t *sh )
+{
+	if ( __atomic_sub_fetch( &sh->refs, 1, __ATOMIC_ACQ_REL ) == 0 )
+	{
+		free( sh );
 	}
+}
 
-	rlen=sizeof(raddr);
-	if ( getpeername( s, (struct sockaddr *)&raddr, &rlen ) )
-	{
-		close( s );
-		af_log_print(LOG_ERR, "%s: rejecting new client, getpeername() failed (%d) %s",\
-			__func__, errno, strerror(errno) );
+/*
+ * Segments of the usual sizes go back to the connection, which keeps a
+ * few of each kind with its slot, so steady traffic doesn't malloc.
+ */
+af_server_buf_t *_af_server_buf_get( af_server_cnx_t *cnx, size_t size, int ref )
+{
+	af_server_buf_t *buf;
 
-		return NULL;
+	if ( ref && ( buf = cnx->out_spare_ref ) != NULL )
+	{
+		cnx->out_spare_ref = buf->next;
+		cnx->out_nspare_ref--;
 	}
-
-	cnx = (af_server_cnx_t *)calloc( 1, sizeof(af_server_cnx_t) );
-	if ( cnx == NULL )
+	else if ( !ref && size == AF_SERVER_BUF_SIZE && ( buf = cnx->out_spare ) != NULL )
 	{
-		close(s);
-		af_log_print( LOG_ERR, "Failed to allocate memory for new connection");
-		return NULL;
+		cnx->out_spare = buf->next;
+		cnx->out_nspare--;
 	}
-
-	/**
-	 * Client socket
-	 */
-	if ( af_server_set_sockopts( s, 0 ) != 0 )
+	else if ( ( buf = malloc( sizeof(*buf) + ( ref ? 0 : size ) ) ) == NULL )
 	{
-		close(s);
-		free(cnx);
 		return NULL;
 	}
 
-	/**
-	 * Dup client socket for file handle
-	 */
-	if ( ( fd_dup = dup( s ) ) < 0 )
+	buf->next = NULL;
+	buf->shared = NULL;
+	buf->len = 0;
+	buf->off = 0;
+	buf->size = size;
+
+	return buf;
+}
+
+void _af_server_buf_free( af_server_cnx_t *cnx, af_server_buf_t *buf )
+{
+	if ( buf->shared )
 	{
-		close( s );
-		free(cnx);
-		af_log_print(LOG_ERR, "%s: dup() failed on fd=%d, errno=%d (%s)", __func__, s, errno, strerror(errno) );
+		_af_server_shared_put( buf->shared );
 
-		return NULL;
+		if ( cnx->out_nspare_ref < AF_SERVER_BUF_SPARE )
+		{
+			buf->next = cnx->out_spare_ref;
+			cnx->out_spare_ref = buf;
+			cnx->out_nspare_ref++;
+			return;
+		}
 	}
-
-	if ( af_server_set_sockopts( fd_dup, 0 ) != 0 )
+	else if ( buf->size == AF_SERVER_BUF_SIZE && cnx->out_nspare < AF_SERVER_BUF_SPARE )
 	{
-		close( s );
-		free(cnx);
-		return NULL;
+		buf->next = cnx->out_spare;
+		cnx->out_spare = buf;
+		cnx->out_nspare++;
+		return;
 	}
 
-	if ( ( cnx->fh = fdopen( fd_dup, "w+"  ) ) == NULL )
-	{
-		close( s );
-		close( fd_dup );
-		free(cnx);
+	free( buf );
+}
 
-		af_log_print( LOG_CRIT, "%s: fdopen() failed for fd=%d", __func__, fd_dup );
+void _af_server_spare_free( af_server_cnx_t *cnx )
+{
+	af_server_buf_t *buf;
 
-		return NULL;
+	while ( ( buf = cnx->out_spare ) != NULL )
+	{
+		cnx->out_spare = buf->next;
+		free( buf );
 	}
 
-	/* set handle to line buffered mode */
-	setlinebuf( cnx->fh );
+	while ( ( buf = cnx->out_spare_ref ) != NULL )
+	{
+		cnx->out_spare_ref = buf->next;
+		free( buf );
+	}
 
-	cnx->fd = s;
-	cnx->raddr = raddr;
-	cnx->server = server;
+	cnx->out_nspare = 0;
+	cnx->out_nspare_ref = 0;
+}
 
-	// Add to the server list
-	cnx->next = server->cnx;
-	server->cnx = cnx;
-	server->num_cnx++;
+void _af_server_out_free( af_server_cnx_t *cnx )
+{
+	af_server_buf_t *buf;
 
-	return cnx;
-}
+	while ( ( buf = cnx->out_head ) != NULL )
+	{
+		cnx->out_head = buf->next;
+		_af_server_buf_free( cnx, buf );
+	}
 
+	cnx->out_tail = NULL;
+	cnx->out_bytes = 0;
+}
 
-void af_server_prompt( af_server_cnx_t *cnx )
+// Write what the socket takes, -1 on a write error
+int _af_server_out_write( af_server_cnx_t *cnx )
 {
-	if ( cnx && (cnx->fd >= 0) && cnx->server )
+	struct iovec     iov[64];
+	af_server_buf_t *buf;
+	ssize_t          n;
+	int              i;
+
+	while ( cnx->out_head )
 	{
-		// Make sure the stream is flushed. (Not sure this is necessary.)
-		if ( cnx->fh )
-			fflush( cnx->fh );
+		for ( i = 0, buf = cnx->out_head; buf && i < 64; buf = buf->next, i++ )
+		{
+			iov[i].iov_base = ( buf->shared ? buf->shared->data : buf->data ) + buf->off;
+			iov[i].iov_len = buf->len - buf->off;
+		}
 
-		send( cnx->fd, cnx->server->prompt, strlen(cnx->server->prompt), 0 );
+		n = writev( cnx->fd, iov, i );
 
-		af_log_print(APPF_MASK_SERVER+LOG_DEBUG, "dcli prompt %s sent", cnx->server->prompt );
-	}
-}
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			if ( errno == EAGAIN || errno == EWOULDBLOCK )
+				break;
 
-void _af_server_rem_instance( af_server_cnx_t *cnx )
-{
-	af_server_cnx_t *pcnx;
+			af_log_print( APPF_MASK_SERVER+LOG_INFO, "client fd %d write failed: errno %d (%s)",
+				cnx->fd, errno, strerror(errno) );
 
-	if ( cnx == NULL )
-		return;
+			return -1;
+		}
 
-	if ( cnx->fh )
-		fclose( cnx->fh );
+		cnx->out_bytes -= n;
 
-	close( cnx->fd );
+		while ( ( buf = cnx->out_head ) != NULL && n >= buf->len - buf->off )
+		{
+			n -= buf->len - buf->off;
+			cnx->out_head = buf->next;
+			_af_server_buf_free( cnx, buf );
+		}
 
-	// remove the connection from the server.
-	pcnx = cnx->server->cnx;
-	if ( cnx == pcnx )
-	{
-		cnx->server->cnx = cnx->next;
-		cnx->server->num_cnx--;
-	}
-	else
-	{
-		// Find it in the server list and remove
-		while( pcnx )
+		if ( buf == NULL )
 		{
-			if ( pcnx->next == cnx )
-			{
-				pcnx->next = cnx->next;
-				cnx->server->num_cnx--;
-				break;
-			}
-			pcnx = pcnx->next;
+			cnx->out_tail = NULL;
+		}
+		else
+		{
+			buf->off += n;
+			break;
 		}
 	}
 
-	free(cnx);
+	return 0;
 }
 
-void af_server_disconnect( af_server_cnx_t *cnx )
+// Poll reports the error and disconnects, the caller may still use cnx
+void _af_server_out_failed( af_server_cnx_t *cnx )
 {
-	if ( cnx == NULL )
-		return;
+	cnx->out_error = 1;
+	_af_server_out_free( cnx );
+	af_poll_enable( cnx->fd, POLLOUT );
+}
 
-	af_poll_rem( cnx->fd );
+int af_server_flush( af_server_cnx_t *cnx )
+{
+	if ( cnx == NULL || cnx->out_error )
+		return -1;
 
-	// Call users disconnection callback
-	if ( cnx->disconnect_callback )
+	if ( _af_server_out_write( cnx ) != 0 )
 	{
-		cnx->disconnect_callback( cnx );
+		_af_server_out_failed( cnx );
+		return -1;
 	}
 
-	// remove the client from our client list
-	af_log_print(APPF_MASK_SERVER+LOG_DEBUG, "dcli client disconnected fd %d", cnx->fd);
-
-	// close the client socket
-	_af_server_rem_instance(cnx);
-}
-
-void _af_server_add_service( char *service, int port, char *prompt )
-{
-	FILE *fh;
-
-	fh = fopen( "/etc/services", "a" );
+	if ( cnx->out_head )
+		af_poll_enable( cnx->fd, POLLOUT );
+	else
+		af_poll_disable( cnx->fd, POLLOUT );
 
-	if ( fh )
+	if ( cnx->out_blocked && cnx->out_bytes <= _af_server_out_low( cnx->server ) )
 	{
-		fprintf( fh, "%-15s %d/tcp       %s\n", service, port, prompt );
-		fclose( fh );
+		_af_server_out_blocked( cnx, 0 );
 	}
+
+	return 0;
 }
 
-int af_server_start( af_server_t *server )
+int af_server_write( af_server_cnx_t *cnx, const void *data, size_t len )
 {
-	int                   s;
-	int                   port;
-	char                 *p;
-	struct sockaddr_in    sin;
+	af_server_buf_t *buf = cnx->out_tail;
+	size_t           n;
+	int              idle = ( cnx->out_head == NULL );
 
-	if ( server->service != NULL )
+	if ( cnx->out_error )
+		return -1;
+
+	while ( len )
 	{
-		port = af_server_get_port( server->service );
-		p = af_server_get_prompt ( server->service );
-		if ( port == 0 || p == NULL )
+		// Fill the tail segment, then chain a new one
+		if ( buf == NULL || buf->len == buf->size )
 		{
-			if ( server->port && server->prompt )
-			{
-				af_log_print( LOG_NOTICE, "%s not found in /etc/services, adding", server->service );
-				_af_server_add_service( server->service, server->port, server->prompt );
+			n = len > AF_SERVER_BUF_SIZE ? len : AF_SERVER_BUF_SIZE;
 
-			}
-			else
+			if ( ( buf = _af_server_buf_get( cnx, n, 0 ) ) == NULL )
 			{
-				af_log_print( LOG_ERR, "%s not found in /etc/services. TCLI Server NOT started", server->service );
+				af_log_print( LOG_ERR, "%s: failed to queue %zu bytes for fd %d", __func__, len, cnx->fd );
 				return -1;
 			}
+
+			if ( cnx->out_tail )
+				cnx->out_tail->next = buf;
+			else
+				cnx->out_head = buf;
+			cnx->out_tail = buf;
 		}
-		else
-		{
-			server->port = port;
-			server->prompt = strdup(p);
-		}
+
+		n = buf->size - buf->len;
+		if ( n > len )
+			n = len;
+
+		memcpy( buf->data + buf->len, data, n );
+		buf->len += n;
+		cnx->out_bytes += n;
+		data = (const char *)data + n;
+		len -= n;
 	}
-	if ( (server->port == 0) || (server->prompt == NULL) )
+
+	// Nothing was waiting for POLLOUT, try to send it now
+	if ( idle )
 	{
-		af_log_print( LOG_ERR, "Server port or prompt not found. Server not started." );
-		return -1;
+		af_server_flush( cnx );
 	}
 
-	/* Get socket */
-	if ( ( s = socket( PF_INET, SOCK_STREAM, IPPROTO_TCP ) ) < 0 )
+	if ( !cnx->out_blocked && cnx->out_bytes >= _af_server_out_high( cnx->server ) )
 	{
-		af_log_print( LOG_ERR, "%s: socket() failed errno=%d (%s)",
-			__func__, errno, strerror(errno) );
+		_af_server_out_blocked( cnx, 1 );
+	}
+
+	return cnx->out_error ? -1 : 0;
+}
+
+// Queue a reference to sh, an idle connection gets it straight away
+int _af_server_write_shared( af_server_cnx_t *cnx, af_server_shared_t *sh )
+{
+	af_server_buf_t *buf;
+	ssize_t          n = 0;
 
+	if ( cnx->out_error )
 		return -1;
-	}
 
-	if ( af_server_set_sockopts( s, 1 ) != 0 )
+	// What the handler already wrote to the stream goes first
+	if ( cnx->fh )
+		fflush( cnx->fh );
+
+	// A connection that doesn't read can't hold every broadcast
+	if ( cnx->out_bytes + sh->len > _af_server_out_max( cnx->server ) )
 	{
+		if ( cnx->out_dropped++ == 0 )
+		{
+			af_log_print( APPF_MASK_SERVER+LOG_WARNING, "client fd %d has %zu bytes queued, dropping broadcasts",
+				cnx->fd, cnx->out_bytes );
+		}
 		return -1;
 	}
-	
-	memset( &sin, '\0', sizeof(sin) );
 
-	sin.sin_family = AF_INET;
-	if ( server->local )
+	if ( cnx->out_head == NULL )
+	{
+		if ( ( n = write( cnx->fd, sh->data, sh->len ) ) < 0 )
+		{
+			if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+			{
+				af_log_print( APPF_MASK_SERVER+LOG_INFO, "client fd %d write failed: errno %d (%s)",
+					cnx->fd, errno, strerror(errno) );
+
+				_af_server_out_failed( cnx );
+				return -1;
+			}
+			n = 0;
+		}
+
+		if ( n == sh->len )
+			return 0;
+	}
+
+	if ( ( buf = _af_server_buf_get( cnx, sh->len, 1 ) ) == NULL )
 	{
-		sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+		af_log_print( LOG_ERR, "%s: failed to queue %zu bytes for fd %d", __func__, sh->len - n, cnx->fd );
+		return -1;
 	}
+
+	__atomic_add_fetch( &sh->refs, 1, __ATOMIC_RELAXED );
+
+	buf->shared = sh;
+	buf->len = sh->len;        // size is sh->len too, writes after it get their own segment
+	buf->off = n;
+
+	if ( cnx->out_tail )
+		cnx->out_tail->next = buf;
 	else
+		cnx->out_head = buf;
+	cnx->out_tail = buf;
+	cnx->out_bytes += sh->len - n;
+
+	af_poll_enable( cnx->fd, POLLOUT );
+
+	if ( !cnx->out_blocked && cnx->out_bytes >= _af_server_out_high( cnx->server ) )
 	{
-		sin.sin_addr.s_addr = htonl( INADDR_ANY );
+		_af_server_out_blocked( cnx, 1 );
 	}
 
-	sin.sin_port = htons( server->port );
+	return 0;
+}
 
-	if ( bind( s, (struct sockaddr*)&sin, sizeof(struct sockaddr) ) < 0 )
-	{
-		close( s );
+int af_server_printf( af_server_cnx_t *cnx, const char *fmt, ... )
+{
+	va_list  ap;
+	char     buf[1024];
+	char    *p = buf;
+	int      len;
+	int      rc;
 
-		af_log_print( LOG_ERR, "bind() failed for port %d, fd=%d errno=%d (%s)",
-					  server->port, s, errno, strerror(errno) );
+	va_start( ap, fmt );
+	len = vsnprintf( buf, sizeof(buf), fmt, ap );
+	va_end( ap );
 
+	if ( len < 0 )
 		return -1;
-	}
 
-	/* Listen for incomming connections */
-	if ( listen( s, server->max_cnx ) != 0 ) 
+	if ( len >= sizeof(buf) )
 	{
-		close( s );
-
-		af_log_print( LOG_ERR, "%s: listen() failed for fd=%d errno=%d (%s)",
-			__func__, s, errno, strerror(errno) );
+		if ( ( p = malloc( len + 1 ) ) == NULL )
+			return -1;
 
-		return -1;
+		va_start( ap, fmt );
+		vsnprintf( p, len + 1, fmt, ap );
+		va_end( ap );
 	}
 
-	server->fd = s;
-	server->num_cnx = 0;
-	server->cnx = NULL;
-
-	// Add pollfd for new connections
-	af_poll_add( server->fd, (POLLIN|POLLPRI), _af_server_handle_new_connection, (void*)server );
+	rc = af_server_write( cnx, p, len );
 
-	return 0;
+	if ( p != buf )
+		free( p );
 
+	return rc;
 }
 
-void af_server_disconnect_all( af_server_t *server )
+ssize_t _af_server_cookie_write( void *cookie, const char *data, size_t len )
 {
-	// close all connections
-	while ( server->cnx )
-	{
-		af_server_disconnect( server->cnx );
-	}
+	// Always take it all, a failed connection is cleaned up from poll
+	af_server_write( (af_server_cnx_t *)cookie, data, len );
+
+	return len;
 }
 
-void af_server_stop( af_server_t *server )
+/*
+ * Connections come from slabs of AF_SERVER_SLAB and go back to the
+ * server's free list on disconnect, keeping their stream, input buffer,
+ * spare output segments and poll registration, so a steady stream of
+ * connections doesn't malloc.  Slabs are
+ * released by af_server_stop().  Called with the server locked.
+ */
+#define AF_SERVER_SLAB           64
+
+struct _af_server_slab_s
+{
+	struct _af_server_slab_s *next;
+	af_server_cnx_t           cnx[AF_SERVER_SLAB];
+};
+
+af_server_cnx_t *_af_server_cnx_get( af_server_t *server )
 {
-	af_server_disconnect_all( server );
+	af_server_slab_t *slab;
+	af_server_cnx_t  *cnx;
+	af_server_cnx_t   keep;
+	int               i;
 
-	af_poll_rem( server->fd );
+	if ( server->cnx_free == NULL )
+	{
+		if ( ( slab = calloc( 1, sizeof(af_server_slab_t) ) ) == NULL )
+			return NULL;
 
-	close( server->fd );
+		slab->next = server->slabs;
+		server->slabs = slab;
 
-	server->fd = -1;
+		for ( i = AF_SERVER_SLAB - 1; i >= 0; i-- )
+		{
+			slab->cnx[i].next = server->cnx_free;
+			server->cnx_free = &slab->cnx[i];
+		}
+	}
+
+	cnx = server->cnx_free;
+	server->cnx_free = cnx->next;
+
+	keep = *cnx;
+	memset( cnx, 0, sizeof(*cnx) );
+	cnx->fh = keep.fh;
+	cnx->in_buf = keep.in_buf;
+	cnx->out_spare = keep.out_spare;
+	cnx->out_spare_ref = keep.out_spare_ref;
+	cnx->out_nspare = keep.out_nspare;
+	cnx->out_nspare_ref = keep.out_nspare_ref;
+
+	return cnx;
 }
 
+void _af_server_cnx_put( af_server_t *server, af_server_cnx_t *cnx )
+{
+	cnx->server = NULL;
+	cnx->reactor = NULL;
+	cnx->prev = NULL;
+	cnx->next = server->cnx_free;
+	server->cnx_free = cnx;
+}
 
-void _af_server_cnx_handle_event( af_poll_t *ap )
+void _af_server_slabs_free( af_server_t *server )
 {
-	int              len = 0;
-	char             buf[2048];
-	af_server_cnx_t *cnx = (af_server_cnx_t *)ap->context;
+	af_server_slab_t *slab;
+	int               i;
 
-	if ( ap->revents & POLLIN )
+	while ( ( slab = server->slabs ) != NULL )
 	{
-		len = read( ap->fd, buf, sizeof(buf)-1 );
+		server->slabs = slab->next;
 
-		// Handle read errors
-		if ( len <= 0 )
+		for ( i = 0; i < AF_SERVER_SLAB; i++ )
 		{
-			if ( errno != EAGAIN || len == 0 )
-			{
-				af_log_print( APPF_MASK_SERVER+LOG_INFO, "client fd %d closed: errno %d (%s)",\
-					ap->fd, errno, strerror(errno)  );
-
-				af_server_disconnect(cnx);
-			}
+			if ( slab->cnx[i].fh )
+				fclose( slab->cnx[i].fh );
+			free( slab->cnx[i].in_buf );
+			_af_server_spare_free( &slab->cnx[i] );
 		}
-		else
-		{
-			// terminate the read data
-			buf[len] = 0;
 
-			if ( cnx->server->command_handler )
-			{
-				af_log_print( APPF_MASK_SERVER+LOG_DEBUG, "DCLI server command [%s]", buf );
-				cnx->server->command_handler( buf, cnx );
-			}
-		}
-	}
-	else if ( ap->revents )
-	{
-		// Anything but POLLIN is an error.
-		af_log_print( APPF_MASK_SERVER+LOG_INFO, "dcli socket error, revents: %d", ap->revents );
-		af_server_disconnect(cnx);
+		free( slab );
+	}
+
+	server->cnx_free = NULL;
+	server->stopped = 0;
+}
+
+/*
+ * Connection timeouts
+ *
+ * One timer per connection, set for the nearer of the idle and session
+ * deadlines.  Commands only note the time, when the timer runs it works
+ * out whether a deadline really passed and sets itself again if not, so
+ * there are no timer calls per command.
+ */
+void _af_server_cnx_timer_arm( af_server_cnx_t *cnx, struct timespec *now )
+{
+	af_server_t *server = cnx->server;
+	long         msec = -1;
+	long         left;
+
+	if ( server->idle_timeout > 0 )
+	{
+		msec = server->idle_timeout * 1000L - timediff( (*now), cnx->last_cmd );
+	}
+
+	if ( server->session_timeout > 0 )
+	{
+		left = server->session_timeout * 1000L - timediff( (*now), cnx->start );
+		if ( msec < 0 || left < msec )
+			msec = left;
+	}
+
+	if ( msec < 1 )
+		msec = 1;
+
+	cnx->timer.sec = msec / 1000;
+	cnx->timer.nsec = ( msec % 1000 ) * 1000000;
+	af_timer_start( &cnx->timer );
+}
+
+void _af_server_cnx_timeout( af_timer_t *timer )
+{
+	af_server_cnx_t *cnx = (af_server_cnx_t *)timer->context;
+	af_server_t     *server = cnx->server;
+	struct timespec  now;
+
+	af_timer_now( &now );
+
+	if ( server->session_timeout > 0 && timediff( now, cnx->start ) >= server->session_timeout * 1000L )
+	{
+		af_log_print( APPF_MASK_SERVER+LOG_INFO, "client fd %d session timeout (%d secs)",
+			cnx->fd, server->session_timeout );
+		af_server_disconnect( cnx );
+	}
+	else if ( server->idle_timeout > 0 && timediff( now, cnx->last_cmd ) >= server->idle_timeout * 1000L )
+	{
+		af_log_print( APPF_MASK_SERVER+LOG_INFO, "client fd %d idle timeout (%d secs)",
+			cnx->fd, server->idle_timeout );
+		af_server_disconnect( cnx );
+	}
+	else
+	{
+		_af_server_cnx_timer_arm( cnx, &now );
+	}
+}
+
+af_server_cnx_t *_af_server_add_connection( af_server_t *server, int s, struct sockaddr *raddr, socklen_t rlen )
+{
+	af_server_cnx_t    *cnx = NULL;
+	cookie_io_functions_t io = { NULL, _af_server_cookie_write, NULL, NULL };
+
+	/* quick check to deny before taking the lock */
+	if ( server->num_cnx >= server->max_cnx )
+	{
+		close( s );
+		af_log_print(LOG_ERR, "%s: rejecting new client connection: max number of sessions (%d) already open",\
+			__func__, server->max_cnx );
+
+		return NULL;
+	}
+
+	/**
+	 * Client socket, nothing to set for unix sockets
+	 */
+	if ( server->path == NULL && af_server_set_sockopts( s, 0 ) != 0 )
+	{
+		close(s);
+		return NULL;
+	}
+
+	pthread_mutex_lock( &server->lock );
+
+	if ( server->num_cnx >= server->max_cnx )
+	{
+		pthread_mutex_unlock( &server->lock );
+		close( s );
+		af_log_print(LOG_ERR, "%s: rejecting new client connection: max number of sessions (%d) already open",\
+			__func__, server->max_cnx );
+
+		return NULL;
+	}
+
+	if ( ( cnx = _af_server_cnx_get( server ) ) == NULL )
+	{
+		pthread_mutex_unlock( &server->lock );
+		close(s);
+		af_log_print( LOG_ERR, "Failed to allocate memory for new connection");
+		return NULL;
+	}
+
+	/**
+	 * Stream for the command handlers, writes land in the output queue.
+	 * The cookie is the slot, so a reused slot keeps its stream.
+	 */
+	if ( cnx->fh == NULL )
+	{
+		if ( ( cnx->fh = fopencookie( cnx, "w", io ) ) == NULL )
+		{
+			_af_server_cnx_put( server, cnx );
+			pthread_mutex_unlock( &server->lock );
+			close( s );
+
+			af_log_print( LOG_CRIT, "%s: fopencookie() failed for fd=%d", __func__, s );
+
+			return NULL;
+		}
+
+		/* set handle to line buffered mode */
+		setlinebuf( cnx->fh );
+	}
+
+	cnx->fd = s;
+	memset( &cnx->raddr, 0, sizeof(cnx->raddr) );
+	memcpy( &cnx->raddr, raddr, rlen < sizeof(cnx->raddr) ? rlen : sizeof(cnx->raddr) );
+	cnx->server = server;
+	cnx->reactor = _af_server_reactor_self;
+
+	// Add to the server list
+	cnx->next = server->cnx;
+	if ( cnx->next )
+		cnx->next->prev = cnx;
+	server->cnx = cnx;
+	server->num_cnx++;
+
+	pthread_mutex_unlock( &server->lock );
+
+	if ( server->idle_timeout > 0 || server->session_timeout > 0 )
+	{
+		af_timer_now( &cnx->start );
+		cnx->last_cmd = cnx->start;
+		cnx->timer.callback = _af_server_cnx_timeout;
+		cnx->timer.context = cnx;
+		cnx->timer.slack = 100;
+		_af_server_cnx_timer_arm( cnx, &cnx->start );
+	}
+
+	return cnx;
+}
+
+
+/*
+ * Peer address for log messages, "addr port" for TCP, IPv4 clients of a
+ * dual-stack listener show as ::ffff:a.b.c.d.
+ */
+char *af_server_cnx_addr( af_server_cnx_t *cnx, char *buf, size_t len )
+{
+	char host[INET6_ADDRSTRLEN];
+	char serv[16];
+
+	if ( cnx->raddr.ss_family == AF_UNIX )
+	{
+		snprintf( buf, len, "unix %s", cnx->server && cnx->server->path ? cnx->server->path : "" );
+	}
+	else if ( getnameinfo( (struct sockaddr *)&cnx->raddr, sizeof(cnx->raddr), host, sizeof(host),
+						   serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV ) == 0 )
+	{
+		snprintf( buf, len, "%s %s", host, serv );
+	}
+	else
+	{
+		snprintf( buf, len, "?" );
+	}
+
+	return buf;
+}
+
+void af_server_prompt( af_server_cnx_t *cnx )
+{
+	if ( cnx && (cnx->fd >= 0) && cnx->server )
+	{
+		// Queue anything still in the stream ahead of the prompt
+		if ( cnx->fh )
+			fflush( cnx->fh );
+
+		af_server_write( cnx, cnx->server->prompt, strlen(cnx->server->prompt) );
+
+		af_log_print(APPF_MASK_SERVER+LOG_DEBUG, "dcli prompt %s sent", cnx->server->prompt );
+	}
+}
+
+void _af_server_rem_instance( af_server_cnx_t *cnx )
+{
+	af_server_t *server;
+
+	if ( cnx == NULL )
+		return;
+
+	server = cnx->server;
+
+	// The stream stays with the slot, push what's in it to the queue
+	if ( cnx->fh )
+		fflush( cnx->fh );
+
+	// Last chance for queued output, then drop it
+	if ( !cnx->out_error )
+		_af_server_out_write( cnx );
+	_af_server_out_free( cnx );
+
+	af_timer_stop( &cnx->timer );
+	af_poll_rem( cnx->fd );
+	close( cnx->fd );
+
+	// remove the connection from the server.
+	pthread_mutex_lock( &server->lock );
+
+	if ( cnx->prev )
+		cnx->prev->next = cnx->next;
+	else
+		server->cnx = cnx->next;
+	if ( cnx->next )
+		cnx->next->prev = cnx->prev;
+
+	server->num_cnx--;
+
+	_af_server_cnx_put( server, cnx );
+
+	pthread_mutex_unlock( &server->lock );
+
+	if ( server->stopped && server->cnx == NULL )
+		_af_server_slabs_free( server );
+}
+
+void af_server_disconnect( af_server_cnx_t *cnx )
+{
+	if ( cnx == NULL )
+		return;
+
+	// From the command handler, the dispatch loop finishes the job
+	if ( cnx->busy )
+	{
+		cnx->closed = 1;
+		return;
+	}
+
+	// Call users disconnection callback
+	if ( cnx->disconnect_callback )
+	{
+		cnx->disconnect_callback( cnx );
+	}
+
+	if ( cnx->out_dropped )
+	{
+		af_log_print( APPF_MASK_SERVER+LOG_INFO, "client fd %d missed %lu broadcasts", cnx->fd, cnx->out_dropped );
+	}
+
+	// remove the client from our client list
+	af_log_print(APPF_MASK_SERVER+LOG_DEBUG, "dcli client disconnected fd %d", cnx->fd);
+
+	// close the client socket
+	_af_server_rem_instance(cnx);
+}
+
+void _af_server_add_service( char *service, int port, char *prompt )
+{
+	FILE *fh;
+
+	fh = fopen( "/etc/services", "a" );
+
+	if ( fh )
+	{
+		fprintf( fh, "%-15s %d/tcp       %s\n", service, port, prompt );
+		fclose( fh );
+	}
+}
+
+/*
+ * Unix socket address for path, '@' at the start for the abstract
+ * namespace.  Returns the address length, 0 if the path doesn't fit.
+ */
+socklen_t _af_unix_addr( struct sockaddr_un *sun, const char *path )
+{
+	size_t len = strlen( path );
+
+	memset( sun, 0, sizeof(*sun) );
+	sun->sun_family = AF_UNIX;
+
+	if ( len >= sizeof(sun->sun_path) )
+	{
+		return 0;
+	}
+
+	// Abstract names start with a nul and aren't terminated
+	if ( path[0] == '@' )
+	{
+		memcpy( sun->sun_path + 1, path + 1, len - 1 );
+		return offsetof( struct sockaddr_un, sun_path ) + len;
+	}
+
+	memcpy( sun->sun_path, path, len );
+	return offsetof( struct sockaddr_un, sun_path ) + len + 1;
+}
+
+int _af_server_listen_unix( af_server_t *server )
+{
+	int                   s, rc;
+	int                   probe;
+	struct sockaddr_un    sun;
+	socklen_t             len;
+
+	if ( ( len = _af_unix_addr( &sun, server->path ) ) == 0 )
+	{
+		af_log_print( LOG_ERR, "%s: socket path %s too long", __func__, server->path );
+		return -1;
+	}
+
+	if ( ( s = socket( AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 ) ) < 0 )
+	{
+		af_log_print( LOG_ERR, "%s: socket() failed errno=%d (%s)",
+			__func__, errno, strerror(errno) );
+
+		return -1;
+	}
+
+	rc = bind( s, (struct sockaddr*)&sun, len );
+
+	if ( rc < 0 && errno == EADDRINUSE && server->path[0] != '@' )
+	{
+		// Left behind by a daemon that's gone if nobody answers on it
+		if ( ( probe = socket( AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0 ) ) >= 0 )
+		{
+			if ( connect( probe, (struct sockaddr*)&sun, len ) < 0 && errno == ECONNREFUSED )
+			{
+				af_log_print( LOG_NOTICE, "%s: removing stale socket %s", __func__, server->path );
+				unlink( server->path );
+				rc = bind( s, (struct sockaddr*)&sun, len );
+			}
+			else
+			{
+				errno = EADDRINUSE;
+			}
+
+			close( probe );
+		}
+	}
+
+	if ( rc < 0 )
+	{
+		close( s );
+
+		af_log_print( LOG_ERR, "bind() failed for %s, fd=%d errno=%d (%s)",
+					  server->path, s, errno, strerror(errno) );
+
+		return -1;
+	}
+
+	/* Listen for incomming connections */
+	if ( listen( s, server->backlog ? server->backlog : server->max_cnx ) != 0 ) 
+	{
+		close( s );
+
+		af_log_print( LOG_ERR, "%s: listen() failed for fd=%d errno=%d (%s)",
+			__func__, s, errno, strerror(errno) );
+
+		return -1;
+	}
+
+	return s;
+}
+
+/*
+ * Fill in the TCP listen address: server->address if set, the IPv4
+ * loopback for server->local, otherwise the IPv6 any address, which with
+ * IPV6_V6ONLY off takes IPv4 connections too (seen as ::ffff:a.b.c.d).
+ * family AF_INET asks for the IPv4 any address, for kernels without IPv6.
+ */
+socklen_t _af_server_inet_addr( af_server_t *server, int family, struct sockaddr_storage *ss )
+{
+	struct sockaddr_in  *sin = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+	struct addrinfo      hints, *res;
+	socklen_t            len;
+	char                 port[16];
+	int                  rc;
+
+	memset( ss, 0, sizeof(*ss) );
+
+	if ( server->address )
+	{
+		memset( &hints, 0, sizeof(hints) );
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+		snprintf( port, sizeof(port), "%d", server->port );
+
+		if ( ( rc = getaddrinfo( server->address, port, &hints, &res ) ) != 0 )
+		{
+			af_log_print( LOG_ERR, "%s: can't resolve %s (%s)", __func__, server->address, gai_strerror(rc) );
+			return 0;
+		}
+
+		len = res->ai_addrlen;
+		memcpy( ss, res->ai_addr, len );
+		freeaddrinfo( res );
+
+		return len;
+	}
+
+	if ( server->local || family == AF_INET )
+	{
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl( server->local ? INADDR_LOOPBACK : INADDR_ANY );
+		sin->sin_port = htons( server->port );
+
+		return sizeof(*sin);
+	}
+
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_addr = in6addr_any;
+	sin6->sin6_port = htons( server->port );
+
+	return sizeof(*sin6);
+}
+
+int _af_server_listen( af_server_t *server, int reuseport )
+{
+	int                     s;
+	int                     val = 1;
+	int                     v6only = 0;
+	struct sockaddr_storage ss;
+	socklen_t               len;
+	char                    name[INET6_ADDRSTRLEN];
+
+	if ( server->path )
+	{
+		return _af_server_listen_unix( server );
+	}
+
+	if ( ( len = _af_server_inet_addr( server, AF_INET6, &ss ) ) == 0 )
+	{
+		return -1;
+	}
+
+	/* Get socket, non-blocking so the acceptor can drain the queue */
+	s = socket( ss.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, IPPROTO_TCP );
+	if ( s < 0 && errno == EAFNOSUPPORT && server->address == NULL && ss.ss_family == AF_INET6 )
+	{
+		af_log_print( LOG_NOTICE, "%s: no IPv6, listening on IPv4 only", __func__ );
+
+		len = _af_server_inet_addr( server, AF_INET, &ss );
+		s = socket( ss.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, IPPROTO_TCP );
+	}
+
+	if ( s < 0 )
+	{
+		af_log_print( LOG_ERR, "%s: socket() failed errno=%d (%s)",
+			__func__, errno, strerror(errno) );
+
+		return -1;
+	}
+
+	if ( af_server_set_sockopts( s, 1 ) != 0 )
+	{
+		close( s );
+		return -1;
+	}
+
+	/* one socket for both IPv6 and IPv4, whatever net.ipv6.bindv6only says */
+	if ( ss.ss_family == AF_INET6 && setsockopt( s, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only) ) < 0 )
+	{
+		af_log_print( LOG_WARNING, "%s: setsockopt(IPV6_V6ONLY) failed for fd=%d errno=%d (%s)",
+			__func__, s, errno, strerror(errno) );
+	}
+
+	/* one listener per reactor, the kernel spreads connections over them */
+	if ( reuseport && setsockopt( s, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val) ) < 0 )
+	{
+		close( s );
+
+		af_log_print( LOG_ERR, "%s: setsockopt(SO_REUSEPORT) failed for fd=%d errno=%d (%s)",
+			__func__, s, errno, strerror(errno) );
+
+		return -1;
+	}
+
+	if ( bind( s, (struct sockaddr*)&ss, len ) < 0 )
+	{
+		close( s );
+
+		if ( getnameinfo( (struct sockaddr*)&ss, len, name, sizeof(name), NULL, 0, NI_NUMERICHOST ) != 0 )
+			strcpy( name, "?" );
+
+		af_log_print( LOG_ERR, "bind() failed for %s port %d, fd=%d errno=%d (%s)",
+					  name, server->port, s, errno, strerror(errno) );
+
+		return -1;
+	}
+
+	/* Listen for incomming connections */
+	if ( listen( s, server->backlog ? server->backlog : server->max_cnx ) != 0 ) 
+	{
+		close( s );
+
+		af_log_print( LOG_ERR, "%s: listen() failed for fd=%d errno=%d (%s)",
+			__func__, s, errno, strerror(errno) );
+
+		return -1;
+	}
+
+	return s;
+}
+
+/*
+ * Reactors
+ *
+ * With server->reactors set each reactor thread has its own SO_REUSEPORT
+ * listener, poll and timers.  Connections stay on the thread that accepted
+ * them, their callbacks and the command handler run there.  Other threads
+ * talk to a reactor through its mailbox, a pipe of fixed size requests
+ * that are written and read whole.
+ */
+#define AF_REACTOR_QUIT          1      // disconnect everything and exit
+#define AF_REACTOR_DISCONNECT    2      // disconnect everything
+#define AF_REACTOR_BROADCAST     3      // queue shared to every connection
+
+typedef struct _af_server_mail_s
+{
+	int                    req;
+	af_server_shared_t    *shared;      // AF_REACTOR_BROADCAST, a reference for the reactor
+} af_server_mail_t;
+
+struct _af_server_reactor_s
+{
+	af_server_t           *server;
+	pthread_t              thread;
+	int                    started;
+	int                    fd;          // listener
+	int                    wake[2];     // mailbox
+	int                    stop;
+	af_poll_control_t      polls;
+	af_timer_control_t     timers;
+};
+
+// The reactor running on this thread, NULL for the daemon's poll
+__thread af_server_reactor_t *_af_server_reactor_self;
+
+int _af_server_reactor_post( af_server_reactor_t *r, int req, af_server_shared_t *sh )
+{
+	af_server_mail_t mail = { req, sh };
+
+	while ( write( r->wake[1], &mail, sizeof(mail) ) < 0 )
+	{
+		if ( errno != EINTR )
+		{
+			af_log_print( LOG_ERR, "%s: reactor mailbox full, request %d lost", __func__, req );
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Connections run by r, NULL for the daemon's poll.  Other reactors keep
+// changing the list so callers work from a copy, see _af_server_cnx_live().
+af_server_cnx_t **_af_server_cnx_snapshot( af_server_t *server, af_server_reactor_t *r, int *n )
+{
+	af_server_cnx_t **own;
+	af_server_cnx_t  *cnx;
+
+	*n = 0;
+
+	pthread_mutex_lock( &server->lock );
+
+	if ( ( own = malloc( (server->num_cnx + 1) * sizeof(*own) ) ) != NULL )
+	{
+		for ( cnx = server->cnx; cnx; cnx = cnx->next )
+		{
+			if ( cnx->reactor == r )
+				own[(*n)++] = cnx;
+		}
+	}
+
+	pthread_mutex_unlock( &server->lock );
+
+	return own;
+}
+
+// Only r hands out slots run by r, and not while it works from a snapshot.
+// A slot that still belongs to the server and r is the same connection.
+int _af_server_cnx_live( af_server_t *server, af_server_reactor_t *r, af_server_cnx_t *cnx )
+{
+	int live;
+
+	pthread_mutex_lock( &server->lock );
+	live = ( cnx->server == server && cnx->reactor == r );
+	pthread_mutex_unlock( &server->lock );
+
+	return live;
+}
+
+// Disconnect the connections this thread runs
+void _af_server_cnx_disconnect_own( af_server_t *server, af_server_reactor_t *r )
+{
+	af_server_cnx_t **own;
+	int               n, i;
+
+	own = _af_server_cnx_snapshot( server, r, &n );
+
+	for ( i = 0; i < n; i++ )
+	{
+		if ( _af_server_cnx_live( server, r, own[i] ) )
+			af_server_disconnect( own[i] );
+	}
+
+	free( own );
+}
+
+// Queue sh to the connections this thread runs
+void _af_server_cnx_broadcast_own( af_server_t *server, af_server_reactor_t *r, af_server_shared_t *sh )
+{
+	af_server_cnx_t **own;
+	int               n, i;
+
+	own = _af_server_cnx_snapshot( server, r, &n );
+
+	for ( i = 0; i < n; i++ )
+	{
+		if ( _af_server_cnx_live( server, r, own[i] ) )
+			_af_server_write_shared( own[i], sh );
+	}
+
+	free( own );
+}
+
+void _af_server_reactor_mail( af_poll_t *ap )
+{
+	af_server_reactor_t *r = (af_server_reactor_t *)ap->context;
+	af_server_mail_t     mail[16];
+	int                  n, i;
+
+	while ( ( n = read( ap->fd, mail, sizeof(mail) ) ) > 0 )
+	{
+		for ( i = 0; i < n / sizeof(mail[0]); i++ )
+		{
+			switch ( mail[i].req )
+			{
+			case AF_REACTOR_BROADCAST:
+				_af_server_cnx_broadcast_own( r->server, r, mail[i].shared );
+				_af_server_shared_put( mail[i].shared );
+				break;
+
+			case AF_REACTOR_QUIT:
+				r->stop = 1;
+				// fall through
+			default:
+				_af_server_cnx_disconnect_own( r->server, r );
+				break;
+			}
+		}
+	}
+}
+
+void *_af_server_reactor_thread( void *arg )
+{
+	af_server_reactor_t *r = (af_server_reactor_t *)arg;
+	sigset_t             set;
+
+	// Signals are for the main thread
+	sigfillset( &set );
+	pthread_sigmask( SIG_BLOCK, &set, NULL );
+
+	// af_poll_*() and af_timer_*() on this thread use its own engine
+	_af_poll_thread = &r->polls;
+	_af_timer_thread = &r->timers;
+	_af_server_reactor_self = r;
+
+	af_poll_add( r->wake[0], POLLIN, _af_server_reactor_mail, r );
+	af_poll_add( r->fd, (POLLIN|POLLPRI), _af_server_handle_new_connection, r->server );
+
+	while ( !r->stop )
+	{
+		af_poll_run( -1 );
+	}
+
+	// The listener is closed by _af_server_reactors_stop(), it may be shared
+	af_poll_rem( r->fd );
+	af_poll_rem( r->wake[0] );
+
+	_af_timer_free( );
+	_af_poll_free( );
+
+	return NULL;
+}
+
+void _af_server_reactors_stop( af_server_t *server )
+{
+	af_server_reactor_t *r;
+	int                  i;
+
+	for ( i = 0; i < server->reactors; i++ )
+	{
+		r = &server->reactor[i];
+		if ( r->started )
+			_af_server_reactor_post( r, AF_REACTOR_QUIT, NULL );
+	}
+
+	for ( i = 0; i < server->reactors; i++ )
+	{
+		r = &server->reactor[i];
+		if ( r->started )
+			pthread_join( r->thread, NULL );
+
+		// A unix listener is shared by all the reactors
+		if ( r->fd >= 0 && ( i == 0 || server->path == NULL ) )
+			close( r->fd );
+
+		if ( r->wake[0] >= 0 )
+		{
+			close( r->wake[0] );
+			close( r->wake[1] );
+		}
+	}
+
+	free( server->reactor );
+	server->reactor = NULL;
+
+	if ( server->wake[0] >= 0 )
+	{
+		af_poll_rem( server->wake[0] );
+		close( server->wake[0] );
+		close( server->wake[1] );
+		server->wake[0] = server->wake[1] = -1;
+	}
+}
+
+// af_server_stop() from a reactor, finish it on the thread that started them
+void _af_server_stop_event( af_poll_t *ap )
+{
+	af_server_t *server = (af_server_t *)ap->context;
+	char         buf[16];
+
+	while ( read( ap->fd, buf, sizeof(buf) ) > 0 )
+		;
+
+	if ( server->reactor )
+		af_server_stop( server );
+}
+
+int _af_server_reactors_start( af_server_t *server )
+{
+	af_server_reactor_t *r;
+	int                  i;
+
+	server->wake[0] = server->wake[1] = -1;
+
+	if ( ( server->reactor = calloc( server->reactors, sizeof(af_server_reactor_t) ) ) == NULL )
+	{
+		af_log_print( LOG_ERR, "%s: no memory for %d reactors", __func__, server->reactors );
+		return -1;
+	}
+
+	if ( pipe2( server->wake, O_NONBLOCK|O_CLOEXEC ) < 0 )
+	{
+		af_log_print( LOG_ERR, "%s: pipe() failed errno=%d (%s)", __func__, errno, strerror(errno) );
+		server->wake[0] = server->wake[1] = -1;
+		free( server->reactor );
+		server->reactor = NULL;
+		return -1;
+	}
+	af_poll_add( server->wake[0], POLLIN, _af_server_stop_event, server );
+
+	for ( i = 0; i < server->reactors; i++ )
+	{
+		r = &server->reactor[i];
+		r->server = server;
+		r->wake[0] = r->wake[1] = -1;
+		r->fd = -1;
+	}
+
+	for ( i = 0; i < server->reactors; i++ )
+	{
+		r = &server->reactor[i];
+
+		// No SO_REUSEPORT spreading for unix sockets, they all poll one listener
+		if ( server->path && i > 0 )
+			r->fd = server->reactor[0].fd;
+		else if ( ( r->fd = _af_server_listen( server, 1 ) ) < 0 )
+			break;
+
+		if ( pipe2( r->wake, O_NONBLOCK|O_CLOEXEC ) < 0 )
+		{
+			af_log_print( LOG_ERR, "%s: pipe() failed errno=%d (%s)", __func__, errno, strerror(errno) );
+			r->wake[0] = r->wake[1] = -1;
+			break;
+		}
+
+		if ( ( errno = pthread_create( &r->thread, NULL, _af_server_reactor_thread, r ) ) != 0 )
+		{
+			af_log_print( LOG_ERR, "%s: pthread_create() failed errno=%d (%s)", __func__, errno, strerror(errno) );
+			break;
+		}
+
+		r->started = 1;
+	}
+
+	if ( i < server->reactors )
+	{
+		_af_server_reactors_stop( server );
+		return -1;
+	}
+
+	// The first listener stands for the server
+	server->fd = server->reactor[0].fd;
+
+	af_log_print( APPF_MASK_SERVER+LOG_INFO, "server port %d started %d reactors", server->port, server->reactors );
+
+	return 0;
+}
+
+int af_server_start( af_server_t *server )
+{
+	int                   port;
+	char                 *p;
+
+	if ( server->service != NULL )
+	{
+		port = af_server_get_port( server->service );
+		p = af_server_get_prompt ( server->service );
+		if ( port == 0 || p == NULL )
+		{
+			if ( server->port && server->prompt )
+			{
+				af_log_print( LOG_NOTICE, "%s not found in /etc/services, adding", server->service );
+				_af_server_add_service( server->service, server->port, server->prompt );
+
+			}
+			else
+			{
+				af_log_print( LOG_ERR, "%s not found in /etc/services. TCLI Server NOT started", server->service );
+				return -1;
+			}
+		}
+		else
+		{
+			server->port = port;
+			server->prompt = strdup(p);
+		}
+	}
+	if ( (server->port == 0 && server->path == NULL) || (server->prompt == NULL) )
+	{
+		af_log_print( LOG_ERR, "Server port or prompt not found. Server not started." );
+		return -1;
+	}
+
+	server->num_cnx = 0;
+	server->cnx = NULL;
+	pthread_mutex_init( &server->lock, NULL );
+
+	if ( server->reactors > 0 )
+	{
+		return _af_server_reactors_start( server );
+	}
+
+	if ( ( server->fd = _af_server_listen( server, 0 ) ) < 0 )
+	{
+		return -1;
+	}
+
+	// Add pollfd for new connections
+	af_poll_add( server->fd, (POLLIN|POLLPRI), _af_server_handle_new_connection, (void*)server );
+
+	return 0;
+
+}
+
+void af_server_disconnect_all( af_server_t *server )
+{
+	af_server_cnx_t *cnx, *next;
+	int              i;
+
+	// Reactors close their own, on their own time
+	if ( server->reactor )
+	{
+		for ( i = 0; i < server->reactors; i++ )
+		{
+			_af_server_reactor_post( &server->reactor[i], AF_REACTOR_DISCONNECT, NULL );
+		}
+		return;
+	}
+
+	// close all connections, one in the command handler is only marked closed
+	for ( cnx = server->cnx; cnx; cnx = next )
+	{
+		next = cnx->next;
+		af_server_disconnect( cnx );
+	}
+}
+
+/*
+ * Send the same data to every connection.  It is copied once and shared
+ * by the output queues, slow connections drain it from poll like any
+ * other output, one with more than out_max queued misses it.  With
+ * reactors each reactor queues it from its own thread.
+ */
+int af_server_broadcast( af_server_t *server, const void *data, size_t len )
+{
+	af_server_shared_t  *sh;
+	af_server_reactor_t *r;
+	int                  i;
+
+	if ( len == 0 )
+		return 0;
+
+	if ( ( sh = malloc( sizeof(*sh) + len ) ) == NULL )
+	{
+		af_log_print( LOG_ERR, "%s: no memory for %zu bytes", __func__, len );
+		return -1;
+	}
+
+	sh->refs = 1;
+	sh->len = len;
+	memcpy( sh->data, data, len );
+
+	if ( server->reactor )
+	{
+		for ( i = 0; i < server->reactors; i++ )
+		{
+			r = &server->reactor[i];
+
+			if ( r == _af_server_reactor_self )
+			{
+				_af_server_cnx_broadcast_own( server, r, sh );
+				continue;
+			}
+
+			__atomic_add_fetch( &sh->refs, 1, __ATOMIC_RELAXED );
+			if ( _af_server_reactor_post( r, AF_REACTOR_BROADCAST, sh ) != 0 )
+				_af_server_shared_put( sh );
+		}
+	}
+	else
+	{
+		_af_server_cnx_broadcast_own( server, NULL, sh );
+	}
+
+	_af_server_shared_put( sh );
+
+	return 0;
+}
+
+void af_server_stop( af_server_t *server )
+{
+	int i;
+
+	if ( server->reactor && _af_server_reactor_self && _af_server_reactor_self->server == server )
+	{
+		// A reactor can't join itself, tell them all to quit and let the
+		// thread that started them join them from its poll
+		for ( i = 0; i < server->reactors; i++ )
+		{
+			_af_server_reactor_post( &server->reactor[i], AF_REACTOR_QUIT, NULL );
+		}
+
+		if ( write( server->wake[1], "", 1 ) < 0 )
+		{
+			// Pipe full, it's been asked already
+		}
+		return;
+	}
+
+	if ( server->reactor )
+	{
+		// Waits for the reactor threads
+		_af_server_reactors_stop( server );
+	}
+	else
+	{
+		af_server_disconnect_all( server );
+
+		af_poll_rem( server->fd );
+
+		close( server->fd );
+	}
+
+	server->fd = -1;
+
+	if ( server->path && server->path[0] != '@' )
+	{
+		unlink( server->path );
+	}
+
+	// From a command handler its connection is still in use, the last
+	// one out frees the slots
+	if ( server->cnx )
+		server->stopped = 1;
+	else
+		_af_server_slabs_free( server );
+}
+
+
+// Run one command, 0 if the connection is still open
+int _af_server_command( af_server_cnx_t *cnx, char *command )
+{
+	if ( cnx->server->command_handler )
+	{
+		af_log_print( APPF_MASK_SERVER+LOG_DEBUG, "DCLI server command [%s]", command );
+
+		// A partial command doesn't count, so a trickle of bytes can't hold the slot
+		if ( cnx->server->idle_timeout > 0 )
+			af_timer_now( &cnx->last_cmd );
+
+		cnx->busy++;
+		cnx->server->command_handler( command, cnx );
+		cnx->busy--;
+	}
+
+	return cnx->closed;
+}
+
+// Run the complete commands in the input buffer, 0 if the connection is still open
+int _af_server_dispatch( af_server_cnx_t *cnx )
+{
+	af_server_t *server = cnx->server;
+	char        *line = cnx->in_buf;
+	char        *end;
+	size_t       left = cnx->in_len;
+	size_t       n;
+
+	// A client not reading replies doesn't get to send more commands
+	while ( left && !cnx->out_blocked )
+	{
+		if ( ( end = memchr( line, server->delimiter, left ) ) == NULL )
+			break;
+
+		n = end - line;
+		*end = '\0';
+		left -= n + 1;
+
+		if ( cnx->in_skip )
+		{
+			cnx->in_skip = 0;
+		}
+		else
+		{
+			if ( server->delimiter == '\n' && n && line[n-1] == '\r' )
+				line[n-1] = '\0';
+
+			if ( _af_server_command( cnx, line ) )
+				return -1;
+		}
+
+		line = end + 1;
+	}
+
+	if ( left && line != cnx->in_buf )
+	{
+		memmove( cnx->in_buf, line, left );
+	}
+	cnx->in_len = left;
+
+	return 0;
+}
+
+int _af_server_cnx_read( af_server_cnx_t *cnx )
+{
+	af_server_t *server = cnx->server;
+	size_t       max_line = server->max_line ? server->max_line : AF_SERVER_LINE_MAX;
+	char         buf[2048];
+	int          len;
+
+	if ( server->delimiter == 0 )
+	{
+		len = read( cnx->fd, buf, sizeof(buf)-1 );
+	}
+	else
+	{
+		if ( cnx->in_buf == NULL && ( cnx->in_buf = malloc( max_line ) ) == NULL )
+		{
+			af_log_print( LOG_ERR, "%s: failed to allocate the input buffer for fd %d", __func__, cnx->fd );
+			return -1;
+		}
+
+		// Full of commands held back while output is blocked, they go first
+		if ( cnx->in_len == max_line )
+			return 0;
+
+		len = read( cnx->fd, cnx->in_buf + cnx->in_len, max_line - cnx->in_len );
+	}
+
+	// Handle read errors
+	if ( len <= 0 )
+	{
+		if ( len < 0 && ( errno == EAGAIN || errno == EINTR ) )
+			return 0;
+
+		af_log_print( APPF_MASK_SERVER+LOG_INFO, "client fd %d closed: errno %d (%s)",\
+			cnx->fd, errno, strerror(errno)  );
+
+		return -1;
+	}
+
+	if ( server->delimiter == 0 )
+	{
+		// terminate the read data
+		buf[len] = 0;
+
+		return _af_server_command( cnx, buf );
+	}
+
+	cnx->in_len += len;
+
+	if ( _af_server_dispatch( cnx ) )
+		return -1;
+
+	// No delimiter in a full buffer, drop up to the next one
+	if ( cnx->in_len == max_line && memchr( cnx->in_buf, server->delimiter, cnx->in_len ) == NULL )
+	{
+		if ( !cnx->in_skip )
+		{
+			af_log_print( APPF_MASK_SERVER+LOG_WARNING, "client fd %d command longer than %zu bytes dropped",
+				cnx->fd, max_line );
+		}
+
+		cnx->in_skip = 1;
+		cnx->in_len = 0;
+	}
+
+	return 0;
+}
+
+void _af_server_cnx_handle_event( af_poll_t *ap )
+{
+	af_server_cnx_t *cnx = (af_server_cnx_t *)ap->context;
+	int              rc = 0;
+
+	if ( ap->revents & POLLOUT )
+	{
+		rc = af_server_flush( cnx );
+
+		// Commands held back while output was blocked
+		if ( rc == 0 && cnx->in_len && cnx->server->delimiter )
+			rc = _af_server_dispatch( cnx );
+	}
+
+	if ( rc == 0 && ( ap->revents & POLLIN ) )
+	{
+		rc = _af_server_cnx_read( cnx );
+	}
+	else if ( rc == 0 && ( ap->revents & ~(POLLIN|POLLOUT) ) )
+	{
+		// Anything but POLLIN/POLLOUT is an error.
+		af_log_print( APPF_MASK_SERVER+LOG_INFO, "dcli socket error, revents: %d", ap->revents );
+		rc = -1;
+	}
+
+	if ( rc != 0 )
+	{
+		af_server_disconnect( cnx );
 	}
 }
 
@@ -496,34 +1816,57 @@ void _af_server_cnx_handle_event( af_poll_t *ap )
  ******************************************************************************/
 void _af_server_handle_new_connection( af_poll_t *ap )
 {
-	af_server_t     *serv = (af_server_t*)ap->context;
-	af_server_cnx_t *cnx;
-
-	if ( ( cnx = _af_server_add_connection( serv ) ) != NULL )
+	af_server_t        *serv = (af_server_t*)ap->context;
+	af_server_cnx_t    *cnx;
+	struct sockaddr_storage raddr;
+	socklen_t           rlen;
+	int                 budget = serv->accept_budget ? serv->accept_budget : AF_SERVER_ACCEPT_BUDGET;
+	int                 s;
+
+	// Take what's queued, up to the budget so connections can't starve the rest of poll
+	while ( budget-- > 0 && serv->fd >= 0 )
 	{
-		af_log_print(APPF_MASK_SERVER+LOG_INFO, 
-                     "accepted new client connection (fd=%d)", 
-                     cnx->fd);
-
-		/* add new client fd to the pollfd list */
-		af_poll_add( cnx->fd, POLLIN, _af_server_cnx_handle_event, cnx );
+		rlen = sizeof(raddr);
+		s = accept4( ap->fd, (struct sockaddr *)&raddr, &rlen, SOCK_NONBLOCK|SOCK_CLOEXEC );
 
-		// Call the user's new connection callback
-		if ( serv->new_connection_callback )
+		if ( s < 0 )
 		{
-			serv->new_connection_callback( cnx, serv->new_connection_context );
+			if ( errno == EINTR || errno == ECONNABORTED )
+				continue;
+
+			if ( errno != EAGAIN && errno != EWOULDBLOCK )
+			{
+				af_log_print(LOG_ERR, "%s: accept4() failed (%d) %s",\
+					__func__, errno, strerror(errno) );
+			}
+			break;
 		}
 
-		/* send dcli prompt to client */
-		af_server_prompt( cnx );
-	}
-	else
-	{
-        /* Mask this - its legal to refuse connections at boot time */
-        /* We end up filling processes logs with this if we leave   */
-        /* without the mask                                         */
-		af_log_print(LOG_ERR, 
-                     "failed to accept new client connection");
+		if ( ( cnx = _af_server_add_connection( serv, s, (struct sockaddr *)&raddr, rlen ) ) != NULL )
+		{
+			af_log_print(APPF_MASK_SERVER+LOG_INFO, 
+						 "accepted new client connection (fd=%d)", 
+						 cnx->fd);
+
+			/* add new client fd to the pollfd list */
+			_af_poll_attach( &cnx->poll, cnx->fd, POLLIN, _af_server_cnx_handle_event, cnx );
+
+			// Call the user's new connection callback
+			if ( serv->new_connection_callback )
+			{
+				serv->new_connection_callback( cnx, serv->new_connection_context );
+			}
+
+			/* send dcli prompt to client */
+			af_server_prompt( cnx );
+		}
+		else
+		{
+			/* Mask this - its legal to refuse connections at boot time */
+			/* We end up filling processes logs with this if we leave   */
+			/* without the mask                                         */
+			af_log_print(LOG_ERR, 
+						 "failed to accept new client connection");
+		}
 	}
 }
-
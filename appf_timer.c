@@ -20,10 +20,20 @@
 /*****************************************************************************/
 
 #include <appf.h>
-//#include <sys/timerfd.h>
 #include <sys/sysinfo.h>
 #include <time.h>
 
+/*
+ * timerfd needs linux 2.6.25 and glibc 2.8. Without it (or if timerfd_create()
+ * fails at run time) timers are run from the af_poll_run() timeout instead.
+ * Build with -DAF_NO_TIMERFD for older systems such as RedHat 7.
+ */
+#if defined(__linux__) && !defined(AF_NO_TIMERFD) && defined(__GLIBC__) && \
+	((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 8)))
+#include <sys/timerfd.h>
+#define AF_HAVE_TIMERFD      1
+#endif
+
 void af_timer_now( struct timespec *now )
 {
 	clock_gettime( CLOCK_MONOTONIC, now );
@@ -47,146 +57,716 @@ time_t *af_timer_curtime( struct timespec *then )
 	return &curtime;
 }
 
-void af_timer_check( )
+/*
+ * Timer engines
+ *
+ *   AF_TIMER_WHEEL  Hierarchical timing wheel with 1 msec ticks. 4 levels of
+ *                   256 slots cover 2^32 msec, anything further out is parked
+ *                   in the top level and placed again when it cascades.
+ *                   Start and stop are O(1), a slot is cascaded down a level
+ *                   only when the wheel reaches it.
+ *   AF_TIMER_HEAP   Binary min-heap on the exact timeout, O(log n).
+ *   AF_TIMER_LIST   The original sorted list, O(n) start and stop.
+ *
+ * All engines hand expired timers to the same expired list, so callbacks
+ * can stop any timer, expired or not, in O(1).
+ */
+
+#define WHEEL_BITS       8
+#define WHEEL_SIZE       (1 << WHEEL_BITS)
+#define WHEEL_MASK       (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS     4
+#define WHEEL_WORDS      (WHEEL_SIZE / 64)
+#define WHEEL_SHIFT( l ) (WHEEL_BITS * (l))
+#define WHEEL_SPAN       ((uint64_t)1 << WHEEL_SHIFT(WHEEL_LEVELS))
+
+typedef struct _af_timer_wheel_s
 {
-	af_timer_t        *tm;
-	struct timespec    now;
-	af_timer_t        *expire_tail;
+	uint64_t          cur;                               // last tick processed
+	af_timer_t       *slot[WHEEL_LEVELS][WHEEL_SIZE];
+	uint64_t          map[WHEEL_LEVELS][WHEEL_WORDS];    // non empty slots
 
-	af_timer_now( &now );
+} af_timer_wheel_t;
 
-	tm = _af_daemon->timers.head;
+#define HEAP_MIN         64
+
+void _af_timer_handle_event( af_poll_t *ap );
+void af_timer_reset_fd( void );
+af_timer_control_t *_af_timer_control( void );
+int _af_timer_schedule( af_timer_control_t *tc, af_timer_t *timer, struct timespec *now );
+void _af_timer_next_period( af_timer_t *timer, struct timespec *now );
 
-	_af_daemon->timers.expired = expire_tail = NULL;
+// Server reactor threads run their own timers, everyone else the daemon's
+__thread af_timer_control_t *_af_timer_thread;
+
+af_timer_control_t *_af_timer_control( void )
+{
+	return _af_timer_thread ? _af_timer_thread : &_af_daemon->timers;
+}
 
-	while ( tm != NULL && timediff( tm->timeout, now ) <= 0 )
+void _af_timer_init( void )
+{
+	af_timer_control_t *tc = _af_timer_control( );
+
+	if ( tc->init )
 	{
-		// remove it from the list
-		_af_daemon->timers.head = tm->next;
+		return;
+	}
 
-		tm->next = NULL;
+	tc->init = TRUE;
+	tc->engine = _af_daemon->timer_engine;
+
+	if ( tc->engine == AF_TIMER_WHEEL )
+	{
+		if ( ( tc->wheel = calloc( 1, sizeof(af_timer_wheel_t) ) ) == NULL )
+		{
+			af_log_print( LOG_ERR, "%s: no memory for timer wheel, using timer list", __func__ );
+			tc->engine = AF_TIMER_LIST;
+		}
+	}
+	else if ( tc->engine != AF_TIMER_HEAP )
+	{
+		tc->engine = AF_TIMER_LIST;
+	}
+
+	tc->fd = -1;
+	tc->timeout.tv_sec = 0;
+	tc->timeout.tv_nsec = 0;
+
+#ifdef AF_HAVE_TIMERFD
+	tc->fd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK );
+	if ( tc->fd < 0 )
+	{
+		af_log_print( APPF_MASK_TIMER+LOG_NOTICE, "timerfd_create() failed errno %d (%s), timers run from poll timeout", 
+					  errno, strerror(errno) );
+		return;
+	}
+
+	if ( af_poll_add( tc->fd, POLLIN, _af_timer_handle_event, (void *)NULL ) != 0 )
+	{
+		close( tc->fd );
+		tc->fd = -1;
+	}
+#endif
+}
+
+/* timespec to msec ticks */
+uint64_t _af_timer_tick( struct timespec *ts, int round_up )
+{
+	uint64_t tick;
+
+	tick = (uint64_t)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+	if ( round_up && (ts->tv_nsec % 1000000) )
+	{
+		tick++;
+	}
+
+	return tick;
+}
+
+/* msec from now until then, rounded up so we never wake early. */
+int _af_timer_msec_until( struct timespec *then, struct timespec *now )
+{
+	long               sec, nsec;
+
+	sec = then->tv_sec - now->tv_sec;
+	nsec = then->tv_nsec - now->tv_nsec;
+
+	if ( (sec < 0) || ((sec == 0) && (nsec <= 0)) )
+	{
+		return 0;
+	}
+	if ( sec >= (INT_MAX / 1000) - 1 )
+	{
+		return INT_MAX;
+	}
+
+	return (int)(sec * 1000 + (nsec + 999999) / 1000000);
+}
+
+int _af_timer_before( struct timespec *a, struct timespec *b )
+{
+	return ( (a->tv_sec < b->tv_sec) || 
+			 ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec)) );
+}
+
+/* Queue a timer for its callback */
+void _af_timer_expire( af_timer_t *tm )
+{
+	af_timer_control_t *tc = _af_timer_control( );
+
+	tc->count--;
+
+	tm->expired = TRUE;
+	tm->next = NULL;
+	tm->prev = tc->expired_tail;
+	if ( tc->expired_tail )
+	{
+		tc->expired_tail->next = tm;
+	}
+	else
+	{
+		tc->expired = tm;
+	}
+	tc->expired_tail = tm;
+}
+
+void _af_timer_unexpire( af_timer_t *tm )
+{
+	af_timer_control_t *tc = _af_timer_control( );
+
+	if ( tm->prev )
+	{
+		tm->prev->next = tm->next;
+	}
+	else
+	{
+		tc->expired = tm->next;
+	}
+	if ( tm->next )
+	{
+		tm->next->prev = tm->prev;
+	}
+	else
+	{
+		tc->expired_tail = tm->prev;
+	}
+
+	tm->expired = FALSE;
+}
+
+/*
+ * Timing wheel
+ */
+void _af_wheel_link( af_timer_wheel_t *w, af_timer_t *tm, int level, int slot )
+{
+	af_timer_t **head = &w->slot[level][slot];
+
+	tm->prev = NULL;
+	tm->next = *head;
+	if ( *head )
+	{
+		(*head)->prev = tm;
+	}
+	*head = tm;
+
+	tm->idx = (level << WHEEL_BITS) | slot;
+	w->map[level][slot >> 6] |= (uint64_t)1 << (slot & 63);
+}
+
+void _af_wheel_unlink( af_timer_wheel_t *w, af_timer_t *tm )
+{
+	int          level = tm->idx >> WHEEL_BITS;
+	int          slot = tm->idx & WHEEL_MASK;
+
+	if ( tm->prev )
+	{
+		tm->prev->next = tm->next;
+	}
+	else
+	{
+		w->slot[level][slot] = tm->next;
+	}
+	if ( tm->next )
+	{
+		tm->next->prev = tm->prev;
+	}
+
+	if ( w->slot[level][slot] == NULL )
+	{
+		w->map[level][slot >> 6] &= ~((uint64_t)1 << (slot & 63));
+	}
+
+	tm->next = tm->prev = NULL;
+}
+
+/* Place a timer by its distance from the current tick. */
+/* first is the earliest tick allowed, cur+1 for new timers, cur when cascading. */
+void _af_wheel_add( af_timer_wheel_t *w, af_timer_t *tm, uint64_t first )
+{
+	uint64_t     expires = tm->expires;
+	uint64_t     delta;
+	int          level;
+
+	if ( expires < first )
+	{
+		expires = first;
+	}
+
+	delta = expires - w->cur;
+	if ( delta >= WHEEL_SPAN )
+	{
+		// Too far out, park it at the end of the top level
+		expires = w->cur + WHEEL_SPAN - 1;
+		delta = WHEEL_SPAN - 1;
+	}
+
+	for ( level = 0; level < WHEEL_LEVELS - 1; level++ )
+	{
+		if ( delta < ((uint64_t)1 << WHEEL_SHIFT(level + 1)) )
+		{
+			break;
+		}
+	}
+
+	_af_wheel_link( w, tm, level, (expires >> WHEEL_SHIFT(level)) & WHEEL_MASK );
+}
+
+/* First non empty slot at or after start, wrapping around. -1 if empty. */
+int _af_wheel_find( uint64_t *map, int start )
+{
+	int          i, word;
+	uint64_t     bits;
+
+	word = start >> 6;
+	bits = map[word] & (~(uint64_t)0 << (start & 63));
+
+	for ( i = 0; i <= WHEEL_WORDS; i++ )
+	{
+		if ( bits )
+		{
+			return (word << 6) + __builtin_ctzll( bits );
+		}
+		word = (word + 1) % WHEEL_WORDS;
+		bits = map[word];
+	}
+
+	return -1;
+}
+
+/* Next tick with work to do, either a level 0 slot to expire or a */
+/* higher level slot to cascade. UINT64_MAX if the wheel is empty. */
+uint64_t _af_wheel_next( af_timer_wheel_t *w )
+{
+	uint64_t     next = UINT64_MAX;
+	uint64_t     base, tick;
+	int          level, slot;
+
+	for ( level = 0; level < WHEEL_LEVELS; level++ )
+	{
+		base = w->cur >> WHEEL_SHIFT(level);
 
-		// Add to expired list
-		if ( _af_daemon->timers.expired == NULL )
+		slot = _af_wheel_find( w->map[level], (base + 1) & WHEEL_MASK );
+		if ( slot < 0 )
 		{
-			_af_daemon->timers.expired = tm;
-			expire_tail = tm;
+			continue;
 		}
-		else
+
+		tick = (base & ~(uint64_t)WHEEL_MASK) | slot;
+		if ( tick <= base )
 		{
-			expire_tail->next = tm;
-			expire_tail = tm;
+			tick += WHEEL_SIZE;
 		}
+		tick <<= WHEEL_SHIFT(level);
 
-		tm = _af_daemon->timers.head;
+		if ( tick < next )
+		{
+			next = tick;
+		}
 	}
 
-	while( _af_daemon->timers.expired )
+	return next;
+}
+
+/* Move the wheel up to now, expiring everything due. Empty ticks are skipped. */
+void _af_wheel_run( af_timer_wheel_t *w, uint64_t now )
+{
+	uint64_t     tick;
+	int          level, slot;
+	af_timer_t  *tm, *ntm;
+
+	while ( (tick = _af_wheel_next( w )) <= now )
 	{
-		// get next timer
-		tm = _af_daemon->timers.expired;
+		w->cur = tick;
 
-		// remove if from the list
-		_af_daemon->timers.expired = tm->next;
+		// Cascade each higher level slot that starts on this tick, top down
+		for ( level = WHEEL_LEVELS - 1; level > 0; level-- )
+		{
+			if ( tick & (((uint64_t)1 << WHEEL_SHIFT(level)) - 1) )
+			{
+				continue;
+			}
 
-		tm->next = NULL;
-		tm->running = FALSE;
+			slot = (tick >> WHEEL_SHIFT(level)) & WHEEL_MASK;
+			tm = w->slot[level][slot];
+			w->slot[level][slot] = NULL;
+			w->map[level][slot >> 6] &= ~((uint64_t)1 << (slot & 63));
 
-		// run the call back
-		(*tm->callback)( tm );
+			while ( tm )
+			{
+				ntm = tm->next;
+				_af_wheel_add( w, tm, tick );
+				tm = ntm;
+			}
+		}
+
+		// Everything left in this tick's slot is due
+		slot = tick & WHEEL_MASK;
+		while ( ( tm = w->slot[0][slot] ) != NULL )
+		{
+			_af_wheel_unlink( w, tm );
+			_af_timer_expire( tm );
+		}
+	}
+
+	// Nothing is due before now, so it's safe to catch up
+	if ( now > w->cur )
+	{
+		w->cur = now;
 	}
 }
 
-void _af_timer_handle_event( af_poll_t *ap );
+/*
+ * Min-heap
+ */
+void _af_heap_set( af_timer_t **heap, int idx, af_timer_t *tm )
+{
+	heap[idx] = tm;
+	tm->idx = idx;
+}
 
-void af_timer_reset_fd( void )
+void _af_heap_up( af_timer_t **heap, int idx )
 {
-/* jck	this routine and its associated timer functions do not appear to be called by the
-//      libappf library and I don't use them in com2net. The timerfd_... family of routines
-//      are gnulib specific and will not appear on other unix flavors. In addition, they
-//	were added to gnulib well after Redhat Linux 7.0 (the target system in my ham shack)
-//	was released. So, commenting this code out has no effect on me...
+	af_timer_t  *tm = heap[idx];
+	int          parent;
 
-	af_timer_t         *timer;
-	struct timespec     now;
-	struct itimerspec   tm;
-	long                sec, nsec;
-	uint64_t            exp_cnt = 0;
+	while ( idx > 0 )
+	{
+		parent = (idx - 1) / 2;
+		if ( !_af_timer_before( &tm->timeout, &heap[parent]->timeout ) )
+		{
+			break;
+		}
+		_af_heap_set( heap, idx, heap[parent] );
+		idx = parent;
+	}
+	_af_heap_set( heap, idx, tm );
+}
 
-	memset( &tm, 0, sizeof(tm) );
+void _af_heap_down( af_timer_t **heap, int cnt, int idx )
+{
+	af_timer_t  *tm = heap[idx];
+	int          child;
 
-	if ( _af_daemon->timers.fd < 0 )
+	while ( (child = idx * 2 + 1) < cnt )
 	{
-		// Initialize the timerfd.
-		_af_daemon->timers.timeout.tv_sec = 0;
-		_af_daemon->timers.fd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK );
-		if ( _af_daemon->timers.fd < 0 )
+		if ( (child + 1 < cnt) && 
+			 _af_timer_before( &heap[child + 1]->timeout, &heap[child]->timeout ) )
 		{
-			af_log_print( LOG_ERR, "Failed timerfd_create() errno %d (%s)", errno, strerror(errno) );
-			return;
+			child++;
 		}
-		// clear off the expire count from the fd.
-		while ( read( _af_daemon->timers.fd, (void *)&exp_cnt, sizeof(exp_cnt) ) > 0 );
+		if ( !_af_timer_before( &heap[child]->timeout, &tm->timeout ) )
+		{
+			break;
+		}
+		_af_heap_set( heap, idx, heap[child] );
+		idx = child;
+	}
+	_af_heap_set( heap, idx, tm );
+}
+
+/* count has already been bumped for the new timer */
+int _af_heap_add( af_timer_control_t *tc, af_timer_t *tm )
+{
+	af_timer_t **heap;
+	int          size;
 
-		af_poll_add( _af_daemon->timers.fd, POLLIN, _af_timer_handle_event, (void *)NULL );
+	if ( tc->count > tc->heap_size )
+	{
+		size = tc->heap_size ? tc->heap_size * 2 : HEAP_MIN;
+		if ( ( heap = realloc( tc->heap, size * sizeof(af_timer_t *) ) ) == NULL )
+		{
+			return -1;
+		}
+		tc->heap = heap;
+		tc->heap_size = size;
 	}
 
-	// Start the timer if there are any on the list.
-	if ( _af_daemon->timers.head )
+	_af_heap_set( tc->heap, tc->count - 1, tm );
+	_af_heap_up( tc->heap, tc->count - 1 );
+
+	return 0;
+}
+
+/* count still includes the timer being removed */
+void _af_heap_rem( af_timer_control_t *tc, af_timer_t *tm )
+{
+	int          idx = tm->idx;
+	int          last = tc->count - 1;
+	af_timer_t  *moved;
+
+	if ( idx != last )
 	{
-		timer = _af_daemon->timers.head;
+		// Fill the hole with the last entry and let it find its place
+		moved = tc->heap[last];
+		_af_heap_set( tc->heap, idx, moved );
+		_af_heap_down( tc->heap, last, idx );
+		_af_heap_up( tc->heap, moved->idx );
+	}
+}
+
+/*
+ * Sorted list
+ */
+void _af_list_add( af_timer_control_t *tc, af_timer_t *timer )
+{
+	af_timer_t      *tm; 
+	af_timer_t      *ntm;
 
-		// Restart the timerfd if it's stopped or there is a shorter timer
-		if ( (_af_daemon->timers.timeout.tv_sec == 0) || 
-			 (timediff(_af_daemon->timers.timeout, timer->timeout) > 0) )
+	/* insert this timer in timeout order */
+	if ( tc->head == NULL || timediff(timer->timeout, tc->head->timeout) <= 0 )
+	{
+		/* its the only or less than the head */
+		timer->next = tc->head;
+		tc->head = timer;
+	}
+	else
+	{
+		/* search for time order insertion */
+		tm = tc->head;
+		ntm = tm->next;
+		while( ntm != NULL )
 		{
-			// Stop the timer if it is running.
-			af_log_print( APPF_MASK_TIMER+LOG_DEBUG, "Timer FD stopped for fd %d timeout %ld.%09ld", _af_daemon->timers.fd, _af_daemon->timers.timeout.tv_sec, _af_daemon->timers.timeout.tv_nsec );
-			timerfd_settime( _af_daemon->timers.fd, 0, &tm, NULL );
-
-			_af_daemon->timers.timeout = timer->timeout;
-	
-			// compute the interval
-			af_timer_now( &now );
-			sec = timer->timeout.tv_sec - now.tv_sec;
-			nsec = timer->timeout.tv_nsec - now.tv_nsec;
-			if ( nsec < 0 )
+			if ( timediff( timer->timeout, ntm->timeout ) <= 0 )
 			{
-				sec--;
-				nsec += 1000000000;
+				/* this timer is less than the next */
+				break;
 			}
-	
-			// Don't allow a 0 timer, just set it for 1 usec.
-			if ( (sec < 0) || ((sec == 0) && (nsec <= 0)) )
+			tm = ntm;
+			ntm = tm->next;
+		}
+		/* insert the timer here */
+		timer->next = ntm;
+		tm->next = timer;
+	}
+}
+
+void _af_list_rem( af_timer_control_t *tc, af_timer_t *timer )
+{
+	af_timer_t           *tm, *ntm;
+
+	// just take it out of the list
+	if ( timer == tc->head )
+	{
+		tc->head = timer->next;
+	}
+	else
+	{
+		tm = tc->head;
+		ntm = tm ? tm->next : NULL;
+		while ( ntm != NULL )
+		{
+			if ( timer == ntm )
+			{
+				// found it, remove it
+				tm->next = ntm->next;
+				break;
+			}
+			tm = ntm;
+			ntm = tm->next;
+		}
+	}
+	timer->next = NULL;
+}
+
+/* Absolute time of the next timer, -1 if there are none. */
+int _af_timer_next_deadline( struct timespec *ts )
+{
+	af_timer_control_t *tc = _af_timer_control( );
+	uint64_t            next;
+
+	if ( tc->count == 0 )
+	{
+		return -1;
+	}
+
+	switch ( tc->engine )
+	{
+	case AF_TIMER_WHEEL:
+		if ( ( next = _af_wheel_next( tc->wheel ) ) == UINT64_MAX )
+		{
+			return -1;
+		}
+		ts->tv_sec = next / 1000;
+		ts->tv_nsec = (next % 1000) * 1000000;
+		break;
+
+	case AF_TIMER_HEAP:
+		*ts = tc->heap[0]->timeout;
+		break;
+
+	default:
+		*ts = tc->head->timeout;
+		break;
+	}
+
+	return 0;
+}
+
+void af_timer_check( void )
+{
+	af_timer_control_t *tc = _af_timer_control( );
+	af_timer_t         *tm;
+	struct timespec     now;
+
+	af_timer_now( &now );
+
+	if ( tc->count )
+	{
+		switch ( tc->engine )
+		{
+		case AF_TIMER_WHEEL:
+			_af_wheel_run( tc->wheel, _af_timer_tick( &now, 0 ) );
+			break;
+
+		case AF_TIMER_HEAP:
+			while ( tc->count && !_af_timer_before( &now, &tc->heap[0]->timeout ) )
 			{
-				sec = 0;
-				nsec = 1000;
+				tm = tc->heap[0];
+				_af_heap_rem( tc, tm );
+				_af_timer_expire( tm );
 			}
-	
-			tm.it_value.tv_sec = sec;
-			tm.it_value.tv_nsec = nsec;
-	
-			// start a relative time out
-			if ( timerfd_settime( _af_daemon->timers.fd, 0, &tm, NULL ) < 0 )
+			break;
+
+		default:
+			while ( tc->head != NULL && timediff( tc->head->timeout, now ) <= 0 )
 			{
-				af_log_print( LOG_ERR, "Failed timerfd_settime() errno %d (%s)", errno, strerror(errno) );
-				return;
+				tm = tc->head;
+				tc->head = tm->next;
+				_af_timer_expire( tm );
 			}
-			af_log_print( APPF_MASK_TIMER+LOG_DEBUG, "Timer fd %d started %ld.%09ld at %ld.%09ld timeout %ld.%09ld", _af_daemon->timers.fd, tm.it_value.tv_sec, tm.it_value.tv_nsec, now.tv_sec, now.tv_nsec, timer->timeout.tv_sec, timer->timeout.tv_nsec );
+			break;
 		}
 	}
-	else
+
+	while( tc->expired )
+	{
+		// get next timer and remove it from the list
+		tm = tc->expired;
+		_af_timer_unexpire( tm );
+
+		tm->next = NULL;
+		tm->prev = NULL;
+		tm->running = FALSE;
+
+		// Periodic timers go back in before the callback, which may stop them
+		if ( tm->periodic && (tm->sec > 0 || tm->nsec > 0) )
+		{
+			_af_timer_next_period( tm, &now );
+			_af_timer_schedule( tc, tm, &now );
+		}
+
+		// run the call back
+		(*tm->callback)( tm );
+	}
+
+	// Point the timerfd at whatever is next.
+	if ( tc->init )
+	{
+		af_timer_reset_fd( );
+	}
+}
+
+/* msec until the first timer expires, rounded up so we never wake early. */
+/* -1 if there are no timers. */
+int af_timer_next_timeout( void )
+{
+	af_timer_control_t *tc = _af_timer_control( );
+	struct timespec     now;
+	uint64_t            tick, next;
+
+	if ( tc->count == 0 )
+	{
+		return (tc->expired ? 0 : -1);
+	}
+
+	af_timer_now( &now );
+
+	switch ( tc->engine )
+	{
+	case AF_TIMER_WHEEL:
+		next = _af_wheel_next( tc->wheel );
+		tick = _af_timer_tick( &now, 0 );
+		if ( next <= tick )
+		{
+			return 0;
+		}
+		return ( (next - tick) > INT_MAX ) ? INT_MAX : (int)(next - tick);
+
+	case AF_TIMER_HEAP:
+		return _af_timer_msec_until( &tc->heap[0]->timeout, &now );
+
+	default:
+		return _af_timer_msec_until( &tc->head->timeout, &now );
+	}
+}
+
+/* Number of poll registrations owned by the timers. */
+int _af_timer_fds( void )
+{
+	af_timer_control_t *tc = _af_timer_control( );
+
+	return ( tc->init && (tc->fd >= 0) ) ? 1 : 0;
+}
+
+/* Timeout for af_poll_run(), -1 when the timerfd wakes the poll for us. */
+int _af_timer_poll_timeout( void )
+{
+	if ( _af_timer_fds( ) )
+	{
+		return -1;
+	}
+
+	return af_timer_next_timeout( );
+}
+
+
+void af_timer_reset_fd( void )
+{
+#ifdef AF_HAVE_TIMERFD
+	af_timer_control_t *tc = _af_timer_control( );
+	struct itimerspec   tm;
+	struct timespec     next;
+
+	if ( tc->fd < 0 )
+	{
+		return;
+	}
+
+	memset( &tm, 0, sizeof(tm) );
+
+	if ( _af_timer_next_deadline( &next ) == 0 )
 	{
-		// Stop the timer no timers are in the list.
-		af_log_print( APPF_MASK_TIMER+LOG_DEBUG, "Timer FD stopped for fd %d timeout %ld.%09ld", _af_daemon->timers.fd, _af_daemon->timers.timeout.tv_sec, _af_daemon->timers.timeout.tv_nsec );
-		timerfd_settime( _af_daemon->timers.fd, 0, &tm, NULL );
-		_af_daemon->timers.timeout.tv_sec = 0;
+		// Already armed for it
+		if ( (tc->timeout.tv_sec == next.tv_sec) && (tc->timeout.tv_nsec == next.tv_nsec) )
+		{
+			return;
+		}
+		tm.it_value = next;
+	}
+	else if ( (tc->timeout.tv_sec == 0) && (tc->timeout.tv_nsec == 0) )
+	{
+		// No timers and already stopped
+		return;
 	}
-jck */
+
+	// Absolute CLOCK_MONOTONIC deadline, one in the past fires right away.
+	// An all zero it_value stops the timer.
+	if ( timerfd_settime( tc->fd, TFD_TIMER_ABSTIME, &tm, NULL ) < 0 )
+	{
+		af_log_print( LOG_ERR, "Failed timerfd_settime() errno %d (%s)", errno, strerror(errno) );
+		return;
+	}
+
+	tc->timeout = tm.it_value;
+
+	af_log_print( APPF_MASK_TIMER+LOG_DEBUG, "Timer fd %d set for %ld.%09ld", tc->fd, tc->timeout.tv_sec, tc->timeout.tv_nsec );
+#endif
 }
 
 void _af_timer_handle_event( af_poll_t *ap )
 {
+	af_timer_control_t *tc = _af_timer_control( );
 	struct timespec  now;
 	long             diff;
 	uint64_t         exp_cnt = 0;
@@ -196,7 +776,7 @@ void _af_timer_handle_event( af_poll_t *ap )
 	if ( ap->revents & POLLIN )
 	{
 		// clear off the expire count from the fd.
-		while ( read( _af_daemon->timers.fd, (void *)&exp_cnt, sizeof(exp_cnt) ) > 0 )
+		while ( read( tc->fd, (void *)&exp_cnt, sizeof(exp_cnt) ) > 0 )
 		{
 			if ( exp_cnt != 1 )
 			{
@@ -207,7 +787,9 @@ void _af_timer_handle_event( af_poll_t *ap )
 	else if ( ap->revents )
 	{
 		// socket error
-		af_log_print( LOG_ERR, "poll error, event %d error (%d) %s on timer fd %d TIMER STOPPED!", ap->revents, errno, strerror(errno), _af_daemon->timers.fd );
+		af_log_print( LOG_ERR, "poll error, event %d error (%d) %s on timer fd %d", ap->revents, errno, strerror(errno), tc->fd );
+		tc->timeout.tv_sec = 0;
+		tc->timeout.tv_nsec = 0;
 		af_timer_reset_fd( );
         return;
 	}
@@ -220,35 +802,134 @@ void _af_timer_handle_event( af_poll_t *ap )
 	}
 
 	// Warn the user if the time out is off by more than .1 seconds
-	diff = (now.tv_sec - _af_daemon->timers.timeout.tv_sec) * 1000;
-	diff += (now.tv_nsec - _af_daemon->timers.timeout.tv_nsec) / 1000000;
+	diff = (now.tv_sec - tc->timeout.tv_sec) * 1000;
+	diff += (now.tv_nsec - tc->timeout.tv_nsec) / 1000000;
 	if ( diff > 100 || diff < -100 )
 	{
 		af_log_print( APPF_MASK_TIMER+LOG_NOTICE, "Timeout off by %ld msec,  now %ld:%ld , timeout should be %ld:%ld",
 					  diff,
 					  now.tv_sec,now.tv_nsec,
-					  _af_daemon->timers.timeout.tv_sec, _af_daemon->timers.timeout.tv_nsec );
+					  tc->timeout.tv_sec, tc->timeout.tv_nsec );
 	}
 
 	af_log_print( APPF_MASK_TIMER+LOG_DEBUG, "Timer event fd %d, expired %"PRIu64" at %ld.%09ld timeout %ld.%09ld", ap->fd, 
-			exp_cnt, now.tv_sec, now.tv_nsec, _af_daemon->timers.timeout.tv_sec, _af_daemon->timers.timeout.tv_nsec );
+			exp_cnt, now.tv_sec, now.tv_nsec, tc->timeout.tv_sec, tc->timeout.tv_nsec );
 
-	// Check for any expired timers.
+	// Mark the fd as stopped, it's one shot.
+	tc->timeout.tv_sec = 0;
+	tc->timeout.tv_nsec = 0;
+
+	// Check for any expired timers, this restarts the fd.
 	af_timer_check();
+}
+
+/* Add the timer's sec/nsec interval to ts. */
+void _af_timer_add_interval( struct timespec *ts, af_timer_t *timer )
+{
+	ts->tv_sec += timer->sec + timer->nsec / 1000000000;
+	ts->tv_nsec += timer->nsec % 1000000000;
+	if ( ts->tv_nsec >= 1000000000 )
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Queue a timer for timer->deadline. Slack pushes the timeout out to the
+ * next multiple of the largest power of two msec that fits in the slack,
+ * timers with similar slack then land on the same tick and share a wakeup.
+ */
+int _af_timer_schedule( af_timer_control_t *tc, af_timer_t *timer, struct timespec *now )
+{
+	uint64_t            tick;
+	uint64_t            gran;
+
+	timer->timeout = timer->deadline;
+	if ( timer->slack > 1 )
+	{
+		for ( gran = 1; gran * 2 <= (uint64_t)timer->slack; gran *= 2 )
+			;
+		tick = _af_timer_tick( &timer->deadline, 1 );
+		tick = (tick + gran - 1) / gran * gran;
+		timer->timeout.tv_sec = tick / 1000;
+		timer->timeout.tv_nsec = (tick % 1000) * 1000000;
+	}
+	timer->expires = _af_timer_tick( &timer->timeout, 1 );
+
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->expired = FALSE;
+	timer->running = TRUE;
+
+	tc->count++;
+
+	switch ( tc->engine )
+	{
+	case AF_TIMER_WHEEL:
+		// An empty wheel can jump straight to now
+		if ( tc->count == 1 )
+		{
+			tc->wheel->cur = _af_timer_tick( now, 0 );
+		}
+		_af_wheel_add( tc->wheel, timer, tc->wheel->cur + 1 );
+		break;
+
+	case AF_TIMER_HEAP:
+		if ( _af_heap_add( tc, timer ) != 0 )
+		{
+			af_log_print( LOG_ERR, "%s: no memory for timer heap, timer NOT started", __func__ );
+			tc->count--;
+			timer->running = FALSE;
+			return -1;
+		}
+		break;
+
+	default:
+		_af_list_add( tc, timer );
+		break;
+	}
 
-	// Mark the fd as stopped.
-	_af_daemon->timers.timeout.tv_sec = 0;
+	return 0;
+}
+
+/*
+ * Next deadline of a periodic timer, one period after the last so it
+ * doesn't drift. Periods that were missed altogether are skipped.
+ */
+void _af_timer_next_period( af_timer_t *timer, struct timespec *now )
+{
+	int64_t             period;
+	int64_t             late;
+
+	_af_timer_add_interval( &timer->deadline, timer );
 
-	// Restart the fd.
-	af_timer_reset_fd( );
+	if ( _af_timer_before( now, &timer->deadline ) )
+	{
+		return;
+	}
+
+	period = (int64_t)timer->sec * 1000000000 + timer->nsec;
+	late = (int64_t)(now->tv_sec - timer->deadline.tv_sec) * 1000000000 + (now->tv_nsec - timer->deadline.tv_nsec);
+
+	af_log_print( APPF_MASK_TIMER+LOG_DEBUG, "Timer skipped %lld periods", (long long)(late / period + 1) );
+
+	late = (late / period + 1) * period;
+	timer->deadline.tv_sec += late / 1000000000;
+	timer->deadline.tv_nsec += late % 1000000000;
+	if ( timer->deadline.tv_nsec >= 1000000000 )
+	{
+		timer->deadline.tv_sec++;
+		timer->deadline.tv_nsec -= 1000000000;
+	}
 }
 
 void af_timer_start( af_timer_t *timer )
 {
-	af_timer_t      *tm; 
-	af_timer_t      *ntm;
-	struct timespec  now;
-	long             sec;
+	af_timer_control_t *tc = _af_timer_control( );
+	struct timespec     now;
+
+	_af_timer_init( );
 
 	/* make sure it's not in the list first */
 	if ( timer->running )
@@ -259,119 +940,83 @@ void af_timer_start( af_timer_t *timer )
 	/* set timeout */
 	af_timer_now( &now );
 
-	sec = timer->sec;
-	timer->timeout.tv_nsec = now.tv_nsec+timer->nsec;
-	if ( timer->timeout.tv_nsec > 1000000000 )
+	timer->deadline = now;
+	_af_timer_add_interval( &timer->deadline, timer );
+
+	if ( _af_timer_schedule( tc, timer, &now ) != 0 )
 	{
-		sec++;
-		timer->timeout.tv_nsec -= 1000000000;
+		return;
 	}
-	timer->timeout.tv_sec = now.tv_sec + sec;
 
-	timer->next = NULL;
-	timer->running = TRUE;
-
-	/* insert this timer in timeout order */
-	if ( _af_daemon->timers.head == NULL || timediff(timer->timeout, _af_daemon->timers.head->timeout) <= 0 )
+	// Fire up the timerfd if this is a new first timer.
+	if ( (tc->fd >= 0) && 
+		 ((tc->timeout.tv_sec == 0) || _af_timer_before( &timer->timeout, &tc->timeout )) )
 	{
-		/* its the only or less than the head */
-		timer->next = _af_daemon->timers.head;
-		_af_daemon->timers.head = timer;
-		// Fire up the timerfd if we have a new head.
 		af_timer_reset_fd( );
 	}
-	else
-	{
-		/* search for time order insertioni */
-		tm = _af_daemon->timers.head;
-		ntm = tm->next;
-		while( ntm != NULL )
-		{
-			if ( timediff( timer->timeout, ntm->timeout ) <= 0 )
-			{
-				/* this timer is less than the nexti */
-				break;
-			}
-			tm = ntm;
-			ntm = tm->next;
-		}
-		/* insert the timer here */
-		timer->next = ntm;
-		tm->next = timer;
-	}
+
 	af_log_print( APPF_MASK_TIMER+LOG_DEBUG, "Timer started at %ld.%09ld timeout %ld.%09ld", now.tv_sec, now.tv_nsec, timer->timeout.tv_sec, timer->timeout.tv_nsec );
 
 }
 
 void af_timer_stop( af_timer_t *timer )
 {
-	af_timer_t           *tm, *ntm;
+	af_timer_control_t *tc = _af_timer_control( );
 
 	if ( timer->running == FALSE )
 	{
 		return;
 	}
 
-	// list empty ?
-	if ( _af_daemon->timers.head != NULL )
+	if ( timer->expired )
 	{
-		// just take it out of the list
-		if ( timer == _af_daemon->timers.head )
-		{
-			_af_daemon->timers.head = timer->next;
-			timer->next = NULL;
-			timer->running = FALSE;
-		}
-		else
-		{
-			tm = _af_daemon->timers.head;
-			ntm = tm->next;
-			while ( ntm != NULL )
-			{
-				if ( timer == ntm )
-				{
-					// found it, remove it
-					tm->next = ntm->next;
-					timer->next = NULL;
-					timer->running = FALSE;
-					break;
-				}
-				tm = ntm;
-				ntm = tm->next;
-			}
-		}
+		/* we are running from a callback, it's waiting to be ran */
+		_af_timer_unexpire( timer );
 	}
-
-	/* are we running from a callback ? */
-	if ( _af_daemon->timers.expired != NULL )
+	else
 	{
-		/* clear timer from expired list if it's waiting to be ran */ 
-		if ( timer == _af_daemon->timers.expired )
+		switch ( tc->engine )
 		{
-			_af_daemon->timers.expired = _af_daemon->timers.expired->next;
-			timer->next = NULL;
-			timer->running = FALSE;
-		}
-		else
-		{
-			tm = _af_daemon->timers.expired;
-			ntm = tm->next;
-			while ( ntm != NULL )
-			{
-				if ( timer == ntm )
-				{
-					/* found it, remove it from expired list */
-					tm->next = ntm->next;
-					timer->next = NULL;
-					timer->running = FALSE;
-					break;
-				}
-				tm = ntm;
-				ntm = tm->next;
-			}
+		case AF_TIMER_WHEEL:
+			_af_wheel_unlink( tc->wheel, timer );
+			break;
+
+		case AF_TIMER_HEAP:
+			_af_heap_rem( tc, timer );
+			break;
+
+		default:
+			_af_list_rem( tc, timer );
+			break;
 		}
+		tc->count--;
 	}
+
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->running = FALSE;
+
 	af_log_print( APPF_MASK_TIMER+LOG_DEBUG, "Timer stopped timeout %ld.%09ld", timer->timeout.tv_sec, timer->timeout.tv_nsec );
 }
 
+/* Release this thread's timers, when a reactor thread exits. */
+void _af_timer_free( void )
+{
+	af_timer_control_t *tc = _af_timer_control( );
+
+	if ( !tc->init )
+	{
+		return;
+	}
+
+	if ( tc->fd >= 0 )
+	{
+		af_poll_rem( tc->fd );
+		close( tc->fd );
+	}
+
+	free( tc->wheel );
+	free( tc->heap );
 
+	memset( tc, 0, sizeof(*tc) );
+}
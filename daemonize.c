@@ -38,6 +38,11 @@ void usage(void)
  */
 void sig_handler(int sigtype)
 {
+	// logrotate's postrotate sends a HUP
+	if ( sigtype == SIGHUP )
+	{
+		af_log_reopen( );
+	}
 }
 
 /*
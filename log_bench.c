@@ -0,0 +1,142 @@
+/*****************************************************************************/
+/*                                                                           */
+/* Purpose: Logger throughput benchmark                                      */
+/*                                                                           */
+/*   Logs the same debug line through the old strftime per line path, the   */
+/*   cached timestamp path, the coarse clock, the binary log and the async   */
+/*   log thread, and prints lines/sec for each. Text goes to /dev/null       */
+/*   unless -f is given, the binary log to /tmp/log_bench.bin.               */
+/*                                                                           */
+/*****************************************************************************/
+
+
+#include <appf.h>
+
+#define DEFAULT_COUNT     1000000
+
+void usage(void)
+{
+	fprintf(stderr, "\nUSAGE: log_bench [options]\n\n");
+	fprintf(stderr, "         -h          Display this message\n");
+	fprintf(stderr, "         -n <count>  Number of lines (default=%d)\n", DEFAULT_COUNT);
+	fprintf(stderr, "         -f <file>   Log file (default=/dev/null)\n\n");
+	exit(1);
+}
+
+/* af_vlog_print() as it was, a localtime/strftime and flush for every line */
+void legacy_log_print( unsigned int msg_mask, const char *format, ... )
+{
+	unsigned int   log_level = msg_mask & LOG_PRIMASK;
+	unsigned int   log_mask = msg_mask & ~LOG_PRIMASK;
+	FILE          *fh = _af_daemon->log_fh;
+	struct timeval tv;
+	time_t         curtime;
+	va_list        ap;
+	char           time_buf[64];
+
+	if ( log_mask && ((log_mask & _af_daemon->log_mask) == 0) )
+		return;
+	if ( log_level > _af_daemon->log_level )
+		return;
+
+	gettimeofday(&tv, NULL);
+	curtime=tv.tv_sec;
+
+	strftime(time_buf, sizeof(time_buf),
+			 "%m-%d-%Y %T.",
+			 localtime(&curtime));
+
+	fprintf(fh, "%s%06d %s: ",
+			time_buf, (int)tv.tv_usec,
+			_af_daemon->log_name );
+
+	va_start(ap, format);
+	vfprintf(fh, format, ap);
+	va_end(ap);
+
+	fprintf(fh, "\n");
+	fflush( fh );
+}
+
+double sec_since( struct timespec *then )
+{
+	struct timespec now;
+
+	af_timer_now( &now );
+
+	return (now.tv_sec - then->tv_sec) + (now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+void bench_mode( const char *name, char *file, int coarse, int async, int legacy, int bin, int count )
+{
+	static af_daemon_t daemon;
+	struct timespec    start;
+	double             t_log, t_all;
+	int                i;
+
+	memset( &daemon, 0, sizeof(daemon) );
+	daemon.appname = "log_bench";
+	daemon.log_name = "log_bench";
+	daemon.log_level = LOG_DEBUG;
+	daemon.log_mask = APPF_MASK_CLIENT;
+	daemon.log_filename = file;
+	daemon.log_coarse_mask = coarse ? APPF_MASK_CLIENT : 0;
+	daemon.log_async = async;
+	daemon.log_ring_size = 16384;
+	daemon.log_bin_filename = bin ? "/tmp/log_bench.bin" : NULL;
+	af_daemon_set( &daemon );
+	af_daemon_start( );
+
+	af_timer_now( &start );
+	for ( i = 0; i < count; i++ )
+	{
+		if ( legacy )
+			legacy_log_print( APPF_MASK_CLIENT+LOG_DEBUG, "%s: prompt detect char 0x%02x state %d", "tcli", i & 0xff, i & 3 );
+		else
+			af_log_print( APPF_MASK_CLIENT+LOG_DEBUG, "%s: prompt detect char 0x%02x state %d", "tcli", i & 0xff, i & 3 );
+	}
+	t_log = sec_since( &start );
+	af_log_flush( );
+	t_all = sec_since( &start );
+
+	printf( "%-8s %12.0f %12.0f %10lu\n", name, count / t_log, count / t_all, daemon.logs.dropped );
+}
+
+int main( int argc, char *argv[] )
+{
+	char  *file = "/dev/null";
+	int    count = DEFAULT_COUNT;
+	int    c;
+
+	while ( ( c = getopt( argc, argv, "hn:f:" ) ) != -1 )
+	{
+		switch ( c )
+		{
+		case 'n':
+			count = atoi( optarg );
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+
+	if ( count <= 0 )
+	{
+		usage();
+	}
+
+	printf( "%-8s %12s %12s %10s\n", "mode", "lines/s", "written/s", "dropped" );
+
+	bench_mode( "legacy", file, 0, 0, 1, 0, count );
+	bench_mode( "cached", file, 0, 0, 0, 0, count );
+	bench_mode( "coarse", file, 1, 0, 0, 0, count );
+	bench_mode( "binary", file, 0, 0, 0, 1, count );
+	// Last, its log thread keeps using the daemon
+	bench_mode( "async", file, 0, 1, 0, 0, count );
+
+	return 0;
+}
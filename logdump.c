@@ -0,0 +1,121 @@
+/*****************************************************************************/
+/*                                                                           */
+/* Purpose: Print a binary log (log_bin_filename) as the usual text log      */
+/*                                                                           */
+/*****************************************************************************/
+
+
+#include <appf.h>
+#include <sys/mman.h>
+
+void usage(void)
+{
+	fprintf(stderr, "\nUSAGE: logdump [options] <binary log>\n\n");
+	fprintf(stderr, "         -h          Display this message\n\n");
+	exit(1);
+}
+
+void dump_record( af_log_bin_hdr_t *hdr, const char *fmts, af_log_bin_rec_t *rec )
+{
+	const unsigned char *args = (const unsigned char *)(rec + 1);
+	int                  args_len = rec->len - sizeof(af_log_bin_rec_t);
+	time_t               curtime = rec->sec;
+	char                 time_buf[64];
+	char                 msg[4096];
+	uint32_t             slen;
+
+	if ( rec->fmt == AF_LOG_BIN_TEXT )
+	{
+		memcpy( &slen, args, 4 );
+		if ( slen > args_len - 4 )
+			slen = args_len - 4;
+		snprintf( msg, sizeof(msg), "%.*s", (int)slen, args + 4 );
+	}
+	else if ( rec->fmt < hdr->fmt_used )
+	{
+		af_log_bin_format( msg, sizeof(msg), fmts + rec->fmt, args, args_len );
+	}
+	else
+	{
+		snprintf( msg, sizeof(msg), "<bad format id %u>", rec->fmt );
+	}
+
+	strftime(time_buf, sizeof(time_buf),
+			 "%m-%d-%Y %T.",
+			 localtime(&curtime));
+
+	printf( "%s%06u %.*s: %s\n", time_buf, rec->usec, (int)strnlen( hdr->name, sizeof(hdr->name) ), hdr->name, msg );
+}
+
+int main( int argc, char *argv[] )
+{
+	af_log_bin_hdr_t *hdr;
+	af_log_bin_rec_t *rec;
+	struct stat       st;
+	unsigned char    *map;
+	unsigned char    *ring;
+	uint64_t          pos;
+	int               fd;
+	int               c;
+
+	while ( ( c = getopt( argc, argv, "h" ) ) != -1 )
+	{
+		switch ( c )
+		{
+		case 'h':
+		default:
+			usage();
+		}
+	}
+
+	if ( optind != argc - 1 )
+	{
+		usage();
+	}
+
+	if ( ( fd = open( argv[optind], O_RDONLY ) ) < 0 || fstat( fd, &st ) < 0 )
+	{
+		fprintf( stderr, "%s: %s\n", argv[optind], strerror(errno) );
+		return 1;
+	}
+
+	map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	if ( map == MAP_FAILED )
+	{
+		fprintf( stderr, "%s: %s\n", argv[optind], strerror(errno) );
+		return 1;
+	}
+
+	hdr = (af_log_bin_hdr_t *)map;
+	if ( st.st_size < sizeof(*hdr) ||
+		 memcmp( hdr->magic, AF_LOG_BIN_MAGIC, sizeof(hdr->magic) ) != 0 ||
+		 hdr->fmt_off + hdr->fmt_size > st.st_size ||
+		 hdr->ring_off + hdr->ring_size > st.st_size )
+	{
+		fprintf( stderr, "%s: not a binary log\n", argv[optind] );
+		return 1;
+	}
+
+	ring = map + hdr->ring_off;
+
+	for ( pos = hdr->tail; pos < hdr->head; pos += rec->len )
+	{
+		rec = (af_log_bin_rec_t *)(ring + pos % hdr->ring_size);
+
+		if ( rec->len < 8 || (rec->len & 7) || rec->len > hdr->ring_size - pos % hdr->ring_size )
+		{
+			fprintf( stderr, "%s: bad record at %" PRIu64 "\n", argv[optind], pos );
+			return 1;
+		}
+
+		// Padding to the end of the ring
+		if ( rec->len < sizeof(*rec) || rec->fmt == AF_LOG_BIN_PAD )
+		{
+			continue;
+		}
+
+		dump_record( hdr, (const char *)map + hdr->fmt_off, rec );
+	}
+
+	return 0;
+}
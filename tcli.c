@@ -70,6 +70,7 @@ typedef struct _connect
 	int busy;				/* server state: busy after command sent, idle once prompt detected */
 	unsigned int connect_timo;	/* connect timeout */
 	unsigned int cmd_timo;		/* command timeout */
+	af_timer_t cmd_timer;		/* fires if the prompt doesn't come back within cmd_timo */
 } connect_t;
 
 
@@ -198,7 +199,8 @@ void usage(void)
 	fprintf(stderr, "         -c <timo>   Specify command timeout in seconds in secs (default=%d)\n", DEFAULT_CMD_TIMO);
 	fprintf(stderr, "         -D <delim>  Specify delim char between commands (default is comma)\n");
 	fprintf(stderr, "         -t <port>   Specify server port\n");
-	fprintf(stderr, "         -u <port>   Specify server name\n");
+	fprintf(stderr, "         -u <host>   Specify server name or address, IPv4 or IPv6\n");
+	fprintf(stderr, "         -U <path>   Connect to a unix socket (@name for the abstract namespace)\n");
 	fprintf(stderr, "         -p <prompt> Specify server prompt\n\n");
 	fprintf(stderr, "note: you must specify a server name or a port number and the tcli prompt string\n\n");
 	exit(1);
@@ -345,7 +347,7 @@ void myexit(int status)
 	exit(status);
 }
 
-void handle_cmd_timeout(void *ignore)	//	where is this used??
+void handle_cmd_timeout(af_timer_t *tm)
 {
 	af_log_print(LOG_ERR, "command timeout (%d secs) expired", tcli.conn.cmd_timo);
 	myexit(1);
@@ -388,6 +390,7 @@ void handle_server_socket_event( af_poll_t *af )
 	case AF_OK:
 		// tcli prompt was detected
 		tcli.conn.busy = FALSE;
+		af_timer_stop( &tcli.conn.cmd_timer );
 		tcli.cmd.current++;
 		break;
 	default:
@@ -457,6 +460,12 @@ int send_tcli_command(void)
 	case AF_OK:
 		// command was sent successfully
 		tcli.conn.busy = TRUE;
+		if ( tcli.conn.cmd_timo )
+		{
+			tcli.conn.cmd_timer.sec = tcli.conn.cmd_timo;
+			tcli.conn.cmd_timer.callback = handle_cmd_timeout;
+			af_timer_start( &tcli.conn.cmd_timer );
+		}
 		exitval = 0;
 		break;
 	default:
@@ -473,7 +482,8 @@ int main_loop(void)
 {
 	while( 1 )
 	{
-		af_poll_run( 100 );
+		// Block until the server answers, the command timer fires or a signal.
+		af_poll_run( tcli.conn.busy ? -1 : 100 );
 
 		if ( tcli.conn.busy == FALSE )
 		{
@@ -507,14 +517,10 @@ int main(int argc, char *argv[])
 	int   port = 0;
 	char *service = NULL;
 	char *prompt = NULL;
-	unsigned int ip = 0;
 	char *default_server_name = (char*)"localhost";
 	char *lpServerName = NULL;
+	char *path = NULL;
 	char *servername = NULL;
-	unsigned int addr;
-	struct hostent *hp;
-	struct sockaddr_in server;
-	unsigned short usport = DEFAULT_PORT;
 	//int socket_type = DEFAULT_PROTO;
 	//int socket_type = SOCK_DGRAM;
 	//int socket_type = SOCK_STREAM;
@@ -528,7 +534,7 @@ int main(int argc, char *argv[])
 	mydaemon.use_syslog = 0;
 
 	/*  read command line args  */
-	while ( (ch = getopt(argc, argv, "o:t:p:u:T:D:c:i:l:m:svxhdn")) != -1 )
+	while ( (ch = getopt(argc, argv, "o:t:p:u:U:T:D:c:i:l:m:svxhdn")) != -1 )
 		switch ( ch )
 		{
 		case 'T':
@@ -564,11 +570,13 @@ int main(int argc, char *argv[])
 			break;
 		case 't':
 			port = atoi(optarg);
-			usport = port;
 			break;
 		case 'u':
 			lpServerName = optarg;
 			break;
+		case 'U':
+			path = optarg;
+			break;
 		case 'p':
 			prompt = optarg;
 			break;
@@ -598,44 +606,21 @@ int main(int argc, char *argv[])
 
 	service = strdup( argv[optind++] );
 
-	if ( ! (ip) ) {
-		if ( lpServerName == NULL ) {
-			servername = default_server_name;
-		} else {
-			servername = lpServerName;
-		}
-		//
-		// Attempt to detect if we should call gethostbyname() or
-		// gethostbyaddr()
-		if (isalpha(servername[0])) {   /* server address is a name */
-			hp = gethostbyname(servername);
-		}
-		else  { /* Convert nnn.nnn address to a usable one */
-			addr = inet_addr(servername);
-			hp = gethostbyaddr((char *)&addr,4,AF_INET);
-		}
-		memset(&server,0,sizeof(server));
-		if (hp == NULL ) {
-			int errsv = errno;
-			int herrsv = h_errno;
-			af_log_print(LOG_INFO,"Client: Cannot resolve address [%s]: Error %d, h_err = %i\n",
-				servername,errsv,herrsv);
-			af_log_print(LOG_INFO,"%s\n", hstrerror(h_errno));
-			if (h_errno == HOST_NOT_FOUND) af_log_print(LOG_INFO,"Note: on linux, ip addresses must have valid RDNS entries\n");
-			ip = server.sin_addr.s_addr = inet_addr(servername);
-			server.sin_family = AF_INET;
-		} else {
-			memcpy(&(server.sin_addr),hp->h_addr,hp->h_length);
-			server.sin_family = hp->h_addrtype;
-			ip = ntohl(server.sin_addr.s_addr);
-		}
-		server.sin_port = htons(usport);
+	if ( lpServerName == NULL ) {
+		servername = default_server_name;
+	} else {
+		servername = lpServerName;
 	}
 
-	af_log_print(LOG_INFO, "tcli server: %s, ip = %u", service, ip);
-//	ip = INADDR_LOOPBACK;	// for debug:	test known ip address
+	af_log_print(LOG_INFO, "tcli server: %s, host = %s", service, servername);
 
-	tcli.conn.client = af_client_new( service, ip, port, prompt );
+	tcli.conn.client = af_client_new( service, 0, port, prompt );
+	if ( tcli.conn.client )
+	{
+		// getaddrinfo() in af_client_connect(), IPv6 or IPv4
+		tcli.conn.client->host = servername;
+		tcli.conn.client->path = path;
+	}
 
 	af_log_print(LOG_INFO, "tcli server: %s, port %d, prompt %s", service, port, prompt );
 
@@ -0,0 +1,170 @@
+/*****************************************************************************/
+/*                                                                           */
+/* Purpose: Timer engine micro benchmark                                     */
+/*                                                                           */
+/*   Runs the same start / re-arm / stop / expire pattern through each       */
+/*   af_timer_t engine and prints nsec per timer. Expiry is CPU time spent   */
+/*   in af_poll_run() firing timers spread over 200 msec.                    */
+/*                                                                           */
+/*****************************************************************************/
+
+
+#include <appf.h>
+
+#define DEFAULT_COUNT     10000
+#define DEFAULT_SPREAD    600       // timeouts are spread over this many seconds
+#define EXPIRE_SPREAD     200       // msec, for the expiry run
+
+void usage(void)
+{
+	fprintf(stderr, "\nUSAGE: timer_bench [options]\n\n");
+	fprintf(stderr, "         -h          Display this message\n");
+	fprintf(stderr, "         -n <count>  Number of timers (default=%d)\n", DEFAULT_COUNT);
+	fprintf(stderr, "         -e <engine> Only run engine 0=wheel 1=heap 2=list\n\n");
+	exit(1);
+}
+
+const char *engine_name[] = { "wheel", "heap", "list" };
+
+af_timer_t *timers;
+int         expired;
+
+void bench_callback( af_timer_t *tm )
+{
+	expired++;
+}
+
+double nsec_since( struct timespec *then )
+{
+	struct timespec now;
+
+	af_timer_now( &now );
+
+	return (now.tv_sec - then->tv_sec) * 1e9 + (now.tv_nsec - then->tv_nsec);
+}
+
+/* CPU time, so the expiry run doesn't count time asleep in poll */
+double cpu_nsec_since( struct timespec *then )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &now );
+
+	return (now.tv_sec - then->tv_sec) * 1e9 + (now.tv_nsec - then->tv_nsec);
+}
+
+void bench_engine( int engine, int count )
+{
+	af_daemon_t      daemon;
+	struct timespec  start;
+	double           t_start, t_rearm, t_stop, t_expire;
+	int              i;
+
+	memset( &daemon, 0, sizeof(daemon) );
+	daemon.appname = "timer_bench";
+	daemon.log_name = "timer_bench";
+	daemon.log_level = LOG_WARNING;
+	daemon.timer_engine = engine;
+	af_daemon_set( &daemon );
+
+	memset( timers, 0, count * sizeof(af_timer_t) );
+	srand( 1 );
+	for ( i = 0; i < count; i++ )
+	{
+		timers[i].sec = rand() % DEFAULT_SPREAD;
+		timers[i].nsec = (rand() % 1000) * 1000000L;
+		timers[i].callback = bench_callback;
+	}
+
+	// Start everything
+	af_timer_now( &start );
+	for ( i = 0; i < count; i++ )
+	{
+		af_timer_start( &timers[i] );
+	}
+	t_start = nsec_since( &start ) / count;
+
+	// Re-arm running timers in random order, like an idle timer on each read
+	af_timer_now( &start );
+	for ( i = 0; i < count; i++ )
+	{
+		af_timer_start( &timers[rand() % count] );
+	}
+	t_rearm = nsec_since( &start ) / count;
+
+	// Stop in random order
+	af_timer_now( &start );
+	for ( i = 0; i < count; i++ )
+	{
+		af_timer_stop( &timers[rand() % count] );
+	}
+	for ( i = 0; i < count; i++ )
+	{
+		af_timer_stop( &timers[i] );
+	}
+	t_stop = nsec_since( &start ) / count;
+
+	// Expire everything through the poll loop
+	for ( i = 0; i < count; i++ )
+	{
+		timers[i].sec = 0;
+		timers[i].nsec = (rand() % EXPIRE_SPREAD) * 1000000L;
+		af_timer_start( &timers[i] );
+	}
+	expired = 0;
+	clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &start );
+	while ( expired < count )
+	{
+		af_poll_run( -1 );
+	}
+	t_expire = cpu_nsec_since( &start ) / count;
+
+	printf( "%-6s %8d %10.1f %10.1f %10.1f %10.1f\n", 
+			engine_name[engine], count, t_start, t_rearm, t_stop, t_expire );
+}
+
+int main(int argc, char *argv[])
+{
+	int  ch;
+	int  count = DEFAULT_COUNT;
+	int  engine = -1;
+
+	while ( (ch = getopt(argc, argv, "n:e:h")) != -1 )
+	{
+		switch ( ch )
+		{
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'e':
+			engine = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	if ( count <= 0 || engine > AF_TIMER_LIST )
+	{
+		usage();
+	}
+
+	if ( ( timers = calloc( count, sizeof(af_timer_t) ) ) == NULL )
+	{
+		fprintf(stderr, "no memory for %d timers\n", count);
+		exit(1);
+	}
+
+	printf( "engine    count  start(ns)  rearm(ns)   stop(ns) expire(ns)\n" );
+	for ( ch = AF_TIMER_WHEEL; ch <= AF_TIMER_LIST; ch++ )
+	{
+		if ( engine < 0 || engine == ch )
+		{
+			bench_engine( ch, count );
+		}
+	}
+
+	return 0;
+}